@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -262,6 +263,39 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* VM calls */
+
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits and fd has taken a2,
+			 * so it is on the stack in the next aligned
+			 * slot, at sp+16.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(off_t));
+			if (err) {
+				break;
+			}
+
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+#endif
+
+
 
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -28,10 +28,17 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <thread.h>
+#include <synch.h>
+#include <vmstat.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -40,20 +47,107 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 
 
 
+/*
+ * Reverse map: every user mapping of a frame, so that page-out can
+ * find all the PTEs to change. The first mapping is kept in the frame
+ * table entry itself; the rest (copy-on-write sharers) are chained.
+ */
+struct frame_rmap {
+        struct addrspace *as;
+        vaddr_t vaddr;
+        struct frame_rmap *next;
+};
+
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
-        unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned free_head:1; /* first frame of a free buddy block */
+        unsigned pinned:1; /* never paged out, mappings not tracked */
+        unsigned order:5; /* log2 size of the free block (free_head only) */
+        unsigned refcount:24; /* references: one per mapping, or one for
+                                 a kernel allocation */
+        uint8_t referenced; /* used since the clock hand last passed;
+                               not a bitfield so frame_touch() can set
+                               it without the lock */
+        union {
+                /* allocated frames */
+                struct {
+                        struct addrspace *as; /* first user mapping,
+                                                 NULL if none */
+                        vaddr_t vaddr;
+                        struct frame_rmap *rmap; /* further mappings */
+                };
+                /* free_head frames */
+                struct {
+                        uint32_t next; /* free list links (frame */
+                        uint32_t prev; /*   numbers, FT_NONE ends) */
+                };
+        };
+        uint32_t npages; /* length of the allocation starting here
+                           (first frame of an allocation only) */
 } ft_entry_t;
 
 
 static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
+static uint32_t clock_hand; /* next frame frame_victim() looks at */
 
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Free frames are kept by a binary buddy allocator: free_list[k]
+ * holds blocks of 2^k frames aligned to 2^k frames. Frame 0 always
+ * belongs to the kernel so it doubles as the list terminator.
+ *
+ * Single free frames are further split by page color (the low bits
+ * of the frame number, see PAGE_COLOR): color_list[c] takes the
+ * place of free_list[0] for frames of color c, so that a frame of a
+ * given color can be found without searching.
+ */
+#define BUDDY_ORDERS 18 /* enough for 512MB of 4k frames */
+#define FT_NONE 0
+
+static uint32_t free_list[BUDDY_ORDERS];
+static uint32_t free_count[BUDDY_ORDERS]; /* blocks on each list */
+static uint32_t color_list[PAGE_COLORS];
+static unsigned color_next; /* where uncolored order-0 allocations look */
+static bool coloring_enabled = true;
+
+/*
+ * Single frames (user pages, page table leaves, small kmalloc pages)
+ * are handed out from a per-cpu magazine so that a page fault doesn't
+ * have to take frame_table_spinlock. A magazine is refilled from, and
+ * drained back to, the buddy lists FRAME_MAG_BATCH frames at a time.
+ * Frames in a magazine are not on any buddy list, so they don't
+ * coalesce until drained.
+ *
+ * Other cpus read frame table entries under frame_table_spinlock
+ * (frame_victim, frame_foreach_mapping), so an entry is only
+ * rewritten under that lock. Frames are claimed when they go into a
+ * magazine from the buddy lists, once per batch, and are given back
+ * when drained: while in a magazine they are allocated with no
+ * references and no mapping, and handing one out or putting one
+ * back only moves its refcount between 0 and 1 (frame_unstock,
+ * frame_stock), which such readers don't care about.
+ *
+ * Each magazine has its own lock. Normally only its cpu takes it;
+ * frame_magazine_drain_all() takes the others when memory runs out.
+ * Lock order: magazine lock, then frame_table_spinlock.
+ */
+#define FRAME_MAG_MAXCPUS 32 /* most cpus sys161 can have */
+#define FRAME_MAG_SIZE 32
+#define FRAME_MAG_BATCH (FRAME_MAG_SIZE / 2)
+
+struct frame_magazine {
+        struct spinlock lock;
+        unsigned count;
+        uint32_t frames[FRAME_MAG_SIZE];
+};
+
+static struct frame_magazine magazines[FRAME_MAG_MAXCPUS];
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
@@ -61,6 +155,25 @@ static uint32_t last_frame;
 
 static struct spinlock frame_table_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Pool of pre-zeroed frames for alloc_zeroed_kpage, kept topped up
+ * by the zerod thread so zero-fill faults do not bzero on the
+ * faulting thread. Pool frames are off the buddy lists but not
+ * allocated; alloc_frames takes them back when memory runs short.
+ * Protected by frame_table_spinlock.
+ */
+#define ZERO_POOL_SIZE 32
+#define ZERO_POOL_LOW (ZERO_POOL_SIZE / 2) /* wake zerod below this */
+#define ZERO_POOL_RESERVE 64 /* free frames zerod leaves alone */
+
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count;
+static bool zero_pool_waking; /* zero_sem already signalled */
+static struct semaphore *zero_sem; /* NULL until zerod is running */
+
+static void buddy_free_range(uint32_t i, uint32_t npages);
+static unsigned zero_pool_drain(void);
+
 /*
  * Called very early in system boot to figure out how much physical
  * RAM is available.
@@ -129,20 +242,36 @@ ram_bootstrap(void)
         for (i = 0; i < (firstpaddr >> PAGE_BITS); i++) {
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
-                frame_table[i].not_last = FALSE;
+                frame_table[i].free_head = FALSE;
+                frame_table[i].pinned = TRUE;
+                frame_table[i].refcount = 1;
+                frame_table[i].referenced = FALSE;
+                frame_table[i].as = NULL;
+                frame_table[i].rmap = NULL;
+                frame_table[i].npages = 1;
         }                                            
         
         /* 
-         * The second range of frames are free
+         * The second range of frames are free; hand them to the
+         * buddy allocator.
          */
         
         first_frame = firstpaddr >> PAGE_BITS;
         
-        for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
-                frame_table[i].allocated = FALSE;
+        for (i = 0; i < BUDDY_ORDERS; i++) {
+                free_list[i] = FT_NONE;
+                free_count[i] = 0;
+        }
+        for (i = 0; i < PAGE_COLORS; i++) {
+                color_list[i] = FT_NONE;
         }
+        buddy_free_range(first_frame, last_frame - first_frame);
+        clock_hand = first_frame;
 
-        
+        for (i = 0; i < FRAME_MAG_MAXCPUS; i++) {
+                spinlock_init(&magazines[i].lock);
+                magazines[i].count = 0;
+        }
 }
 
 /*
@@ -189,90 +318,384 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Buddy allocator. All of these are called with frame_table_spinlock
+ * held (or during boot).
  */
 
+/* The free list a 2^ORDER block at frame I belongs on */
+static uint32_t *buddy_list(uint32_t i, unsigned order)
+{
+        if (order == 0) {
+                return &color_list[PAGE_COLOR(i << PAGE_BITS)];
+        }
+        return &free_list[order];
+}
 
-static paddr_t alloc_one_frame(unsigned int npages)
+static void buddy_push(uint32_t i, unsigned order)
 {
-        unsigned int i;
+        uint32_t *list = buddy_list(i, order);
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        frame_table[i].free_head = TRUE;
+        frame_table[i].order = order;
+        frame_table[i].prev = FT_NONE;
+        frame_table[i].next = *list;
+        if (*list != FT_NONE) {
+                frame_table[*list].prev = i;
+        }
+        *list = i;
+        free_count[order]++;
+}
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+static void buddy_remove(uint32_t i)
+{
+        unsigned order = frame_table[i].order;
 
-                        spinlock_release(&frame_table_spinlock);
+        KASSERT(frame_table[i].free_head == TRUE);
+
+        if (frame_table[i].prev != FT_NONE) {
+                frame_table[frame_table[i].prev].next = frame_table[i].next;
+        } else {
+                *buddy_list(i, order) = frame_table[i].next;
+        }
+        if (frame_table[i].next != FT_NONE) {
+                frame_table[frame_table[i].next].prev = frame_table[i].prev;
+        }
+        frame_table[i].free_head = FALSE;
+        free_count[order]--;
+}
+
+/*
+ * Free the 2^order block at frame i, merging it with its buddy for as
+ * long as the buddy is also a whole free block.
+ */
+static void buddy_free_block(uint32_t i, unsigned order)
+{
+        uint32_t buddy;
 
-                        return (paddr_t) (i << PAGE_BITS);
+        while (order + 1 < BUDDY_ORDERS) {
+                buddy = i ^ (1 << order);
+                if (buddy < first_frame || buddy + (1 << order) > last_frame ||
+                    frame_table[buddy].free_head == FALSE ||
+                    frame_table[buddy].order != order) {
+                        break;
                 }
+                buddy_remove(buddy);
+                if (buddy < i) {
+                        i = buddy;
+                }
+                order++;
         }
-        
-        /* Did not find an unallocated frame :-( */
+        buddy_push(i, order);
+}
 
-        spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * aligned power-of-two blocks it contains.
+ */
+static void buddy_free_range(uint32_t i, uint32_t npages)
+{
+        uint32_t j;
+        unsigned order;
+
+        for (j = i; j < i + npages; j++) {
+                frame_table[j].allocated = FALSE;
+                frame_table[j].free_head = FALSE;
+                frame_table[j].refcount = 0;
+                frame_table[j].referenced = FALSE;
+        }
+
+        while (npages > 0) {
+                order = 0;
+                while (order + 1 < BUDDY_ORDERS &&
+                       (i & ((1 << (order + 1)) - 1)) == 0 &&
+                       (1U << (order + 1)) <= npages) {
+                        order++;
+                }
+                buddy_free_block(i, order);
+                i += 1 << order;
+                npages -= 1 << order;
+        }
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+/*
+ * Take a free 2^ORDER block off the buddy lists, splitting a larger
+ * one if need be. Returns FT_NONE if there is none.
+ */
+static uint32_t buddy_alloc(unsigned order)
 {
-        unsigned int i,j;
+        unsigned k;
+        uint32_t i;
 
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        for (k = order; k < BUDDY_ORDERS && free_count[k] == 0; k++) {
+                /* nothing */
+        }
+        if (k == BUDDY_ORDERS) {
+                /* Did not find a big enough block :-( */
+                return FT_NONE;
+        }
 
-        spinlock_acquire(&frame_table_spinlock);
+        if (k == 0) {
+                /* no color wanted; hand them out in turn */
+                while (color_list[color_next] == FT_NONE) {
+                        color_next = (color_next + 1) % PAGE_COLORS;
+                }
+                i = color_list[color_next];
+                color_next = (color_next + 1) % PAGE_COLORS;
+        }
+        else {
+                i = free_list[k];
+        }
+        buddy_remove(i);
+        while (k > order) {
+                k--;
+                buddy_push(i + (1 << k), k);
+        }
+        return i;
+}
 
-        i = first_frame; j = 0;
+/*
+ * Take a free frame of page color COLOR off the buddy lists,
+ * splitting the smallest block that has one. Returns FT_NONE if
+ * there is none.
+ */
+static uint32_t buddy_alloc_color(unsigned color)
+{
+        unsigned k;
+        uint32_t i, want;
+
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+        KASSERT(color < PAGE_COLORS);
+
+        if (color_list[color] != FT_NONE) {
+                i = color_list[color];
+                buddy_remove(i);
+                return i;
+        }
 
-        while (i < (last_frame - npages) && j < npages) {
-                if (frame_table[i+j].allocated == TRUE) {
-                        i = i + j + 1; /* continue scan after allocated frame */
-                        j = 0;         /* restart the count */
+        /*
+         * A block of PAGE_COLORS frames or more has every color; a
+         * smaller one has a run of colors starting at its own (we
+         * only look at the first block on the list).
+         */
+        for (k = 1; k < BUDDY_ORDERS; k++) {
+                i = free_list[k];
+                if (i == FT_NONE) {
+                        continue;
                 }
-                else {
-                        j = j + 1; /* increment count of free frames */
+                if ((1U << k) >= PAGE_COLORS ||
+                    (color & ~((1U << k) - 1)) == PAGE_COLOR(i << PAGE_BITS)) {
+                        break;
                 }
         }
+        if (k == BUDDY_ORDERS) {
+                return FT_NONE;
+        }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
-                for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
-                        frame_table[j].not_last = TRUE;  /* as a contiguous block */
+        /* split down to the frame we want, freeing the other halves */
+        buddy_remove(i);
+        want = i + (color & ((1U << k) - 1));
+        while (k > 0) {
+                k--;
+                if (want >= i + (1U << k)) {
+                        buddy_push(i, k);
+                        i += 1U << k;
+                }
+                else {
+                        buddy_push(i + (1U << k), k);
                 }
+        }
+        KASSERT(i == want);
+        return i;
+}
+
+static void frame_claim(uint32_t i, unsigned npages)
+{
+        uint32_t j;
+
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+
+        for (j = i; j < i + npages; j++) {
                 frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+                frame_table[j].pinned = FALSE;
+                frame_table[j].refcount = 1;
+                frame_table[j].referenced = FALSE;
+                frame_table[j].as = NULL;
+                frame_table[j].rmap = NULL;
+        }
+        frame_table[i].npages = npages;
+}
+
+/* Hand out frame I from a magazine; see frame_magazine above. */
+static void frame_unstock(uint32_t i)
+{
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].refcount == 0);
+        frame_table[i].refcount = 1;
+        frame_table[i].referenced = FALSE;
+}
+
+/* Put frame I, which nobody maps, back in a magazine. */
+static void frame_stock(uint32_t i)
+{
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].refcount == 1);
+        KASSERT(frame_table[i].as == NULL);
+        KASSERT(frame_table[i].npages == 1);
+        frame_table[i].refcount = 0;
+}
 
+/*
+ * Allocate NPAGES contiguous frames from the buddy lists: take the
+ * smallest block that fits and give back the tail of the block if
+ * NPAGES is not a power of two.
+ */
+static uint32_t buddy_alloc_frames(unsigned int npages)
+{
+        unsigned order;
+        uint32_t i;
+
+        order = 0;
+        while ((1U << order) < npages) {
+                order++;
+        }
+        if (order >= BUDDY_ORDERS) {
+                return FT_NONE;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        i = buddy_alloc(order);
+        if (i == FT_NONE) {
                 spinlock_release(&frame_table_spinlock);
-                
-                return (paddr_t) (i << PAGE_BITS);
+                return FT_NONE;
+        }
+
+        frame_claim(i, npages);
+        if (npages < (1U << order)) {
+                buddy_free_range(i + npages, (1 << order) - npages);
         }
-        
-        /* Did not find an unallocated contiguous range of frames :-( */
 
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
+
+        return i;
+}
+
+/*
+ * The current cpu's magazine, or NULL early in boot (before curcpu
+ * exists) or on a cpu beyond FRAME_MAG_MAXCPUS. Call at splhigh so
+ * we stay on this cpu.
+ */
+static struct frame_magazine *frame_magazine(void)
+{
+        if (!CURCPU_EXISTS() || curcpu->c_number >= FRAME_MAG_MAXCPUS) {
+                return NULL;
+        }
+        return &magazines[curcpu->c_number];
 }
 
+/* Move frames from the buddy lists into MAG; returns how many. */
+static unsigned frame_magazine_fill(struct frame_magazine *mag)
+{
+        unsigned n;
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (n = 0; n < FRAME_MAG_BATCH; n++) {
+                i = buddy_alloc(0);
+                if (i == FT_NONE) {
+                        break;
+                }
+                frame_claim(i, 1);
+                frame_table[i].refcount = 0;
+                mag->frames[mag->count++] = i;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return n;
+}
+
+/* Give the last NFRAMES frames in MAG back to the buddy lists. */
+static void frame_magazine_drain(struct frame_magazine *mag, unsigned nframes)
+{
+        spinlock_acquire(&frame_table_spinlock);
+        while (nframes > 0 && mag->count > 0) {
+                buddy_free_range(mag->frames[--mag->count], 1);
+                nframes--;
+        }
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Empty every magazine back into the buddy lists so the frames can
+ * coalesce or be used by another cpu. Returns the number of frames
+ * that came back.
+ */
+static unsigned frame_magazine_drain_all(void)
+{
+        unsigned i, total;
+
+        total = 0;
+        for (i = 0; i < FRAME_MAG_MAXCPUS; i++) {
+                spinlock_acquire(&magazines[i].lock);
+                total += magazines[i].count;
+                frame_magazine_drain(&magazines[i], magazines[i].count);
+                spinlock_release(&magazines[i].lock);
+        }
+        return total;
+}
+
+static paddr_t alloc_frames(unsigned int npages)
+{
+        struct frame_magazine *mag;
+        uint32_t i;
+        int spl;
+
+        if (npages == 1) {
+                spl = splhigh();
+                mag = frame_magazine();
+                if (mag != NULL) {
+                        spinlock_acquire(&mag->lock);
+                        if (mag->count > 0 || frame_magazine_fill(mag) > 0) {
+                                i = mag->frames[--mag->count];
+                                frame_unstock(i);
+                                spinlock_release(&mag->lock);
+                                splx(spl);
+                                vmstat_inc(VMSTAT_FRAME_ALLOC);
+                                return (paddr_t) (i << PAGE_BITS);
+                        }
+                        spinlock_release(&mag->lock);
+                }
+                splx(spl);
+        }
+
+        i = buddy_alloc_frames(npages);
+        if (i == FT_NONE &&
+            frame_magazine_drain_all() + zero_pool_drain() > 0) {
+                /* the frames we need may be in magazines or the pool */
+                i = buddy_alloc_frames(npages);
+        }
+        if (i == FT_NONE) {
+                return (paddr_t) 0;
+        }
+        vmstat_add(VMSTAT_FRAME_ALLOC, npages);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/*
+ * Only the last reference is freed this way (shared user frames go
+ * through frame_unmap), and it belongs to the caller alone: nobody
+ * else can take a new reference to it, so a single frame goes back
+ * to the magazine without frame_table_spinlock (see frame_stock).
+ */
 static void free_frames(vaddr_t vaddr)
 {
+        struct frame_magazine *mag;
         paddr_t paddr;
         uint32_t i;
+        int spl;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
@@ -280,36 +703,347 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
-        spinlock_acquire(&frame_table_spinlock);
-
-        if (frame_table[i].allocated == FALSE) { /* check for double free error */
+        /* check for double free error (refcount 0: in a magazine) */
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].refcount == 0) {
                 panic("Double free error!!");
         }
-        
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+
+        KASSERT(frame_table[i].refcount == 1);
+        KASSERT(frame_table[i].as == NULL);
+        vmstat_add(VMSTAT_FRAME_FREE, frame_table[i].npages);
+
+        if (frame_table[i].npages == 1) {
+                spl = splhigh();
+                mag = frame_magazine();
+                if (mag != NULL) {
+                        spinlock_acquire(&mag->lock);
+                        if (mag->count == FRAME_MAG_SIZE) {
+                                frame_magazine_drain(mag, FRAME_MAG_BATCH);
+                        }
+                        frame_stock(i);
+                        mag->frames[mag->count++] = i;
+                        spinlock_release(&mag->lock);
+                        splx(spl);
+                        return;
                 }
+                splx(spl);
         }
+
+        spinlock_acquire(&frame_table_spinlock);
+        buddy_free_range(i, frame_table[i].npages);
         spinlock_release(&frame_table_spinlock);
 }
         
+/*
+ * Free N single frames nobody else holds (see free_frames), taking
+ * the magazine lock once rather than once per frame.
+ */
+static void frames_free_batch(const uint32_t *idx, unsigned n)
+{
+        struct frame_magazine *mag;
+        unsigned j;
+        int spl;
+
+        if (n == 0) {
+                return;
+        }
+        vmstat_add(VMSTAT_FRAME_FREE, n);
+
+        spl = splhigh();
+        mag = frame_magazine();
+        if (mag != NULL) {
+                spinlock_acquire(&mag->lock);
+        }
+        else {
+                spinlock_acquire(&frame_table_spinlock);
+        }
+
+        for (j = 0; j < n; j++) {
+                KASSERT(frame_table[idx[j]].allocated == TRUE);
+                KASSERT(frame_table[idx[j]].refcount == 1);
+                KASSERT(frame_table[idx[j]].npages == 1);
+
+                if (mag == NULL) {
+                        buddy_free_range(idx[j], 1);
+                        continue;
+                }
+                if (mag->count == FRAME_MAG_SIZE) {
+                        frame_magazine_drain(mag, FRAME_MAG_BATCH);
+                }
+                frame_stock(idx[j]);
+                mag->frames[mag->count++] = idx[j];
+        }
+
+        if (mag != NULL) {
+                spinlock_release(&mag->lock);
+        }
+        else {
+                spinlock_release(&frame_table_spinlock);
+        }
+        splx(spl);
+}
+
+paddr_t
+frame_alloc_block(unsigned order)
+{
+        uint32_t i, j;
+
+        KASSERT(order < BUDDY_ORDERS);
+
+        spinlock_acquire(&frame_table_spinlock);
+        i = buddy_alloc(order);
+        if (i == FT_NONE) {
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+        for (j = i; j < i + (1U << order); j++) {
+                frame_claim(j, 1);
+        }
+        spinlock_release(&frame_table_spinlock);
+        vmstat_add(VMSTAT_FRAME_ALLOC, 1U << order);
+
+        return (paddr_t) (i << PAGE_BITS);
+}
+
+/* Give every frame in the zeroed pool back; returns how many. */
+static unsigned zero_pool_drain(void)
+{
+        unsigned n;
+
+        spinlock_acquire(&frame_table_spinlock);
+        n = zero_pool_count;
+        while (zero_pool_count > 0) {
+                buddy_free_range(zero_pool[--zero_pool_count], 1);
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return n;
+}
+
+/* Free frames on the buddy lists. Call with frame_table_spinlock. */
+static unsigned buddy_nfree(void)
+{
+        unsigned k, n;
+
+        n = 0;
+        for (k = 0; k < BUDDY_ORDERS; k++) {
+                n += free_count[k] << k;
+        }
+        return n;
+}
+
+/*
+ * The zerod thread: when woken, moves free frames into the zeroed
+ * pool until it is full, zeroing them with no lock held and yielding
+ * after each so that it mostly runs when nothing else wants to. It
+ * leaves ZERO_POOL_RESERVE frames on the buddy lists.
+ */
+static void frame_zero_thread(void *data1, unsigned long data2)
+{
+        uint32_t i;
+
+        (void)data1;
+        (void)data2;
+
+        while (1) {
+                P(zero_sem);
+                spinlock_acquire(&frame_table_spinlock);
+                zero_pool_waking = false;
+                spinlock_release(&frame_table_spinlock);
+
+                while (1) {
+                        spinlock_acquire(&frame_table_spinlock);
+                        i = FT_NONE;
+                        if (zero_pool_count < ZERO_POOL_SIZE &&
+                            buddy_nfree() > ZERO_POOL_RESERVE) {
+                                i = buddy_alloc(0);
+                        }
+                        spinlock_release(&frame_table_spinlock);
+                        if (i == FT_NONE) {
+                                break;
+                        }
+
+                        bzero((void *) PADDR_TO_KVADDR(i << PAGE_BITS),
+                              PAGE_SIZE);
+                        vmstat_inc(VMSTAT_ZERO_BG);
+
+                        spinlock_acquire(&frame_table_spinlock);
+                        if (zero_pool_count < ZERO_POOL_SIZE) {
+                                zero_pool[zero_pool_count++] = i;
+                        }
+                        else {
+                                buddy_free_range(i, 1);
+                        }
+                        spinlock_release(&frame_table_spinlock);
+
+                        thread_yield();
+                }
+        }
+}
+
+/* Start zerod and fill the pool for the first time. */
+void
+frame_zero_bootstrap(void)
+{
+        int result;
+
+        zero_sem = sem_create("zerod", 0);
+        if (zero_sem == NULL) {
+                panic("frame_zero_bootstrap: Out of memory\n");
+        }
+        result = thread_fork("zerod", NULL, frame_zero_thread, NULL, 0);
+        if (result) {
+                panic("frame_zero_bootstrap: thread_fork failed: %s\n",
+                      strerror(result));
+        }
+        zero_pool_waking = true;
+        V(zero_sem);
+}
+
+/*
+ * Page coloring: a user page gets a frame of its own page color, so
+ * that consecutive virtual pages land in different cache colors the
+ * way they would in a physically contiguous mapping. It can be
+ * turned off (coloring menu command) to compare.
+ */
+void
+frame_setcoloring(bool enabled)
+{
+        coloring_enabled = enabled;
+}
+
+bool
+frame_coloring(void)
+{
+        return coloring_enabled;
+}
+
+/*
+ * A frame of page color COLOR: from this cpu's magazine if it has
+ * one of that color, else from the buddy lists.
+ */
+static uint32_t frame_alloc_color(unsigned color)
+{
+        struct frame_magazine *mag;
+        unsigned j;
+        uint32_t i;
+        int spl;
+
+        i = FT_NONE;
+        spl = splhigh();
+        mag = frame_magazine();
+        if (mag != NULL) {
+                spinlock_acquire(&mag->lock);
+                for (j = 0; j < mag->count; j++) {
+                        if (PAGE_COLOR(mag->frames[j] << PAGE_BITS) == color) {
+                                i = mag->frames[j];
+                                mag->frames[j] = mag->frames[--mag->count];
+                                frame_unstock(i);
+                                break;
+                        }
+                }
+                spinlock_release(&mag->lock);
+        }
+        splx(spl);
+        if (i != FT_NONE) {
+                return i;
+        }
+
+        spinlock_acquire(&frame_table_spinlock);
+        i = buddy_alloc_color(color);
+        if (i != FT_NONE) {
+                frame_claim(i, 1);
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return i;
+}
+
+vaddr_t
+alloc_colored_kpage(vaddr_t uvaddr)
+{
+        uint32_t i;
+
+        if (coloring_enabled) {
+                i = frame_alloc_color(PAGE_COLOR(uvaddr));
+                if (i != FT_NONE) {
+                        vmstat_inc(VMSTAT_COLOR_HIT);
+                        vmstat_inc(VMSTAT_FRAME_ALLOC);
+                        return PADDR_TO_KVADDR(i << PAGE_BITS);
+                }
+                /* a frame of the wrong color beats none */
+                vmstat_inc(VMSTAT_COLOR_MISS);
+        }
+        return alloc_kpages(1);
+}
+
+/*
+ * A page of zeros for the user page at UVADDR. Comes from the zeroed
+ * pool if there is one of the right color there (a hit), else is
+ * allocated and zeroed here (a miss). Wakes zerod when the pool runs
+ * low.
+ */
+vaddr_t
+alloc_zeroed_kpage(vaddr_t uvaddr)
+{
+        unsigned j;
+        uint32_t i;
+        vaddr_t v;
+        bool wake;
+
+        i = FT_NONE;
+        wake = false;
+        spinlock_acquire(&frame_table_spinlock);
+        for (j = zero_pool_count; j > 0; j--) {
+                if (!coloring_enabled ||
+                    PAGE_COLOR(zero_pool[j - 1] << PAGE_BITS) ==
+                    PAGE_COLOR(uvaddr)) {
+                        i = zero_pool[j - 1];
+                        zero_pool[j - 1] = zero_pool[--zero_pool_count];
+                        frame_claim(i, 1);
+                        break;
+                }
+        }
+        if (zero_pool_count < ZERO_POOL_LOW && zero_sem != NULL &&
+            !zero_pool_waking) {
+                zero_pool_waking = true;
+                wake = true;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        if (wake) {
+                V(zero_sem);
+        }
+
+        if (i != FT_NONE) {
+                vmstat_inc(VMSTAT_ZERO_HIT);
+                vmstat_inc(VMSTAT_FRAME_ALLOC);
+                return PADDR_TO_KVADDR(i << PAGE_BITS);
+        }
+
+        vmstat_inc(VMSTAT_ZERO_MISS);
+        v = alloc_colored_kpage(uvaddr);
+        if (v != 0) {
+                bzero((void *) v, PAGE_SIZE);
+        }
+        return v;
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
         paddr_t paddr;
-        if (npages > 1 ) {
-                paddr = alloc_multiple_frames(npages);
-        }
-        else {
-                paddr = alloc_one_frame(npages);
+
+        paddr = alloc_frames(npages);
+        while (paddr == 0) {
+                /* memory full of user pages; push some out to swap */
+                if (vm_reclaim()) {
+                        return 0;
+                }
+                paddr = alloc_frames(npages);
         }
-        
-	if (paddr == 0) {
-		return 0;
-	}
 	return PADDR_TO_KVADDR(paddr);
 }
 
@@ -319,3 +1053,367 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * User frames are reference counted by mapping: frame_map adds a
+ * mapping of the frame at VADDR in AS, and frame_unmap removes one,
+ * freeing the frame with the last. A frame fresh from alloc_kpages
+ * has the allocation's reference, which its first mapping takes
+ * over.
+ *
+ * Pinned frames (the zero page) only count their mappings.
+ */
+int
+frame_map(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct frame_rmap *node = NULL;
+        ft_entry_t *e = &frame_table[i];
+
+        vaddr &= PAGE_FRAME;
+
+        for (;;) {
+                spinlock_acquire(&frame_table_spinlock);
+                KASSERT(e->allocated == TRUE);
+                if (e->pinned) {
+                        e->refcount++;
+                        break;
+                }
+                if (e->as == NULL) {
+                        KASSERT(e->refcount == 1);
+                        e->as = as;
+                        e->vaddr = vaddr;
+                        e->referenced = TRUE;
+                        break;
+                }
+                if (node != NULL) {
+                        node->as = as;
+                        node->vaddr = vaddr;
+                        node->next = e->rmap;
+                        e->rmap = node;
+                        node = NULL;
+                        e->refcount++;
+                        break;
+                }
+
+                /* can't kmalloc under the lock; get a node and retry */
+                spinlock_release(&frame_table_spinlock);
+                node = kmalloc(sizeof(*node));
+                if (node == NULL) {
+                        return ENOMEM;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        if (node != NULL) {
+                kfree(node);
+        }
+        return 0;
+}
+
+/*
+ * Remove the mapping of frame I at VADDR in AS and drop its
+ * reference. Returns true if that was the last reference, in which
+ * case the caller frees the frame. A removed chain node is handed
+ * back in *NODE for the caller to kfree once the lock is released.
+ */
+static bool frame_unmap_locked(uint32_t i, struct addrspace *as, vaddr_t vaddr,
+                               struct frame_rmap **node)
+{
+        struct frame_rmap **pp;
+        ft_entry_t *e = &frame_table[i];
+
+        KASSERT(spinlock_do_i_hold(&frame_table_spinlock));
+        KASSERT(e->allocated == TRUE);
+
+        *node = NULL;
+        if (!e->pinned) {
+                if (e->as == as && e->vaddr == vaddr) {
+                        /* move the first chained mapping up */
+                        *node = e->rmap;
+                        if (*node != NULL) {
+                                e->as = (*node)->as;
+                                e->vaddr = (*node)->vaddr;
+                                e->rmap = (*node)->next;
+                        }
+                        else {
+                                e->as = NULL;
+                        }
+                }
+                else {
+                        for (pp = &e->rmap; *pp != NULL; pp = &(*pp)->next) {
+                                if ((*pp)->as == as && (*pp)->vaddr == vaddr) {
+                                        break;
+                                }
+                        }
+                        KASSERT(*pp != NULL);
+                        *node = *pp;
+                        *pp = (*node)->next;
+                }
+        }
+        if (e->refcount == 1) {
+                return true;
+        }
+        e->refcount--;
+        return false;
+}
+
+void
+frame_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        struct frame_rmap *node;
+        bool last;
+
+        spinlock_acquire(&frame_table_spinlock);
+        last = frame_unmap_locked(paddr >> PAGE_BITS, as, vaddr & PAGE_FRAME,
+                                  &node);
+        spinlock_release(&frame_table_spinlock);
+
+        if (node != NULL) {
+                kfree(node);
+        }
+        if (last) {
+                free_frames(PADDR_TO_KVADDR(paddr));
+        }
+}
+
+/*
+ * frame_unmap for N pages of AS at once, for tearing down address
+ * spaces: the mappings are removed under one acquisition of
+ * frame_table_spinlock and the freed frames go back to the magazine
+ * (or buddy lists) in one go.
+ */
+void
+frame_unmap_batch(struct addrspace *as, const paddr_t *paddrs,
+                  const vaddr_t *vaddrs, unsigned n)
+{
+        struct frame_rmap *nodes, *node;
+        uint32_t freed[FRAME_BATCH_MAX];
+        unsigned j, nfreed;
+
+        KASSERT(n <= FRAME_BATCH_MAX);
+
+        nodes = NULL;
+        nfreed = 0;
+        spinlock_acquire(&frame_table_spinlock);
+        for (j = 0; j < n; j++) {
+                if (frame_unmap_locked(paddrs[j] >> PAGE_BITS, as,
+                                       vaddrs[j] & PAGE_FRAME, &node)) {
+                        freed[nfreed++] = paddrs[j] >> PAGE_BITS;
+                }
+                if (node != NULL) {
+                        node->next = nodes;
+                        nodes = node;
+                }
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        while (nodes != NULL) {
+                node = nodes;
+                nodes = nodes->next;
+                kfree(node);
+        }
+        frames_free_batch(freed, nfreed);
+}
+
+/*
+ * Call FN on every mapping of the frame, with frame_table_spinlock
+ * held. FN must not sleep or allocate. Returns the number of
+ * mappings; a frame that has been freed (or handed to the kernel)
+ * since frame_victim picked it has none, and FN is not called.
+ */
+unsigned
+frame_foreach_mapping(paddr_t paddr,
+                      void (*fn)(struct addrspace *as, vaddr_t vaddr, void *data),
+                      void *data)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct frame_rmap *node;
+        unsigned n = 0;
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].pinned == TRUE ||
+            frame_table[i].as == NULL) {
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+        fn(frame_table[i].as, frame_table[i].vaddr, data);
+        n++;
+        for (node = frame_table[i].rmap; node != NULL; node = node->next) {
+                fn(node->as, node->vaddr, data);
+                n++;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        return n;
+}
+
+/*
+ * Forget every mapping of a frame that has just been paged out, and
+ * free it.
+ */
+void
+frame_unmap_all(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        struct frame_rmap *list, *node;
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].pinned == FALSE);
+        list = frame_table[i].rmap;
+        frame_table[i].rmap = NULL;
+        frame_table[i].as = NULL;
+        frame_table[i].refcount = 1;
+        spinlock_release(&frame_table_spinlock);
+
+        while (list != NULL) {
+                node = list;
+                list = list->next;
+                kfree(node);
+        }
+        free_frames(PADDR_TO_KVADDR(paddr));
+}
+
+/* Keep a frame (the zero page) out of page-out for good. */
+void
+frame_pin(paddr_t paddr)
+{
+        spinlock_acquire(&frame_table_spinlock);
+        frame_table[paddr >> PAGE_BITS].pinned = TRUE;
+        spinlock_release(&frame_table_spinlock);
+}
+
+unsigned
+frame_refcount(paddr_t paddr)
+{
+        unsigned count;
+        uint32_t i = paddr >> PAGE_BITS;
+
+        spinlock_acquire(&frame_table_spinlock);
+        count = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+
+        return count;
+}
+
+
+/*
+ * Set the reference bit for the page-out clock. The TLB has none, so
+ * we emulate it by calling this on every TLB refill (see
+ * frame_victim). This is on the refill fast path and takes no lock;
+ * a single byte store cannot disturb the other fields.
+ */
+void
+frame_touch(paddr_t paddr)
+{
+        frame_table[paddr >> PAGE_BITS].referenced = TRUE;
+}
+
+/* Clear the reference bit, returning what it was (RSS-limit clock). */
+bool
+frame_clear_referenced(paddr_t paddr)
+{
+        bool was;
+
+        spinlock_acquire(&frame_table_spinlock);
+        was = frame_table[paddr >> PAGE_BITS].referenced;
+        frame_table[paddr >> PAGE_BITS].referenced = FALSE;
+        spinlock_release(&frame_table_spinlock);
+
+        return was;
+}
+
+/*
+ * Pick a frame to page out using the clock (second-chance)
+ * algorithm. Frames referenced since the hand last passed get their
+ * bit cleared and are skipped. The caller must flush the TLB after
+ * evicting so that pages whose bit was cleared fault (and are
+ * re-referenced) the next time they are used.
+ *
+ * Any mapped user frame can be picked, shared or not; the caller
+ * finds its mappings with frame_foreach_mapping. Callers hold
+ * swap_lock, so two page-outs never pick the same frame, and neither
+ * unmapping nor copy-on-write can drop the frame's last reference
+ * while it is being paged out. The lock is dropped before returning,
+ * though, so the caller still checks with frame_foreach_mapping that
+ * the frame has mappings before it writes the frame out.
+ */
+int
+frame_victim(paddr_t *paddr)
+{
+        uint32_t i, n, nframes;
+
+        nframes = last_frame - first_frame;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (n = 0; n < 2 * nframes; n++) {
+                i = clock_hand;
+                clock_hand++;
+                if (clock_hand >= last_frame) {
+                        clock_hand = first_frame;
+                }
+
+                if (frame_table[i].allocated == FALSE ||
+                    frame_table[i].pinned == TRUE ||
+                    frame_table[i].as == NULL) {
+                        continue;
+                }
+                if (frame_table[i].referenced == TRUE) {
+                        frame_table[i].referenced = FALSE;
+                        continue;
+                }
+
+                *paddr = (paddr_t) (i << PAGE_BITS);
+
+                spinlock_release(&frame_table_spinlock);
+                return 0;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        /* nothing pageable */
+        return ENOMEM;
+}
+
+/*
+ * Print the number of free blocks of each size, and the frames held
+ * in per-cpu magazines (frames menu command).
+ */
+void
+frame_printstats(void)
+{
+        unsigned k, total, inmags, inpool;
+        uint32_t count[BUDDY_ORDERS];
+        unsigned magcount[FRAME_MAG_MAXCPUS];
+
+        for (k = 0; k < FRAME_MAG_MAXCPUS; k++) {
+                spinlock_acquire(&magazines[k].lock);
+                magcount[k] = magazines[k].count;
+                spinlock_release(&magazines[k].lock);
+        }
+        spinlock_acquire(&frame_table_spinlock);
+        for (k = 0; k < BUDDY_ORDERS; k++) {
+                count[k] = free_count[k];
+        }
+        inpool = zero_pool_count;
+        spinlock_release(&frame_table_spinlock);
+
+        total = 0;
+        kprintf("order  pages  free blocks\n");
+        for (k = 0; k < BUDDY_ORDERS; k++) {
+                if (count[k] > 0) {
+                        kprintf("%5u %6u  %u\n", k, 1U << k, count[k]);
+                }
+                total += count[k] << k;
+        }
+        inmags = 0;
+        for (k = 0; k < FRAME_MAG_MAXCPUS; k++) {
+                if (magcount[k] > 0) {
+                        kprintf("cpu%u magazine: %u frames\n", k, magcount[k]);
+                }
+                inmags += magcount[k];
+        }
+        kprintf("zeroed pool: %u frames\n", inpool);
+        kprintf("%u of %u frames free\n", total + inmags + inpool,
+                last_frame - first_frame);
+}
@@ -856,8 +856,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* pages are moved with VOP_READ/VOP_WRITE; nothing to set up */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -29,6 +29,17 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The disk does one sector per command, through a one-sector buffer
+ * on the card. Each call to lhd_io becomes a request for a run of
+ * sectors on the disk's queue. The interrupt handler moves each
+ * sector between the card and the request's buffer and starts the
+ * next one, so a requester sleeps once per request rather than once
+ * per sector. When a request finishes, the next is chosen in C-SCAN
+ * order: the nearest one at or past the last sector in the direction
+ * of increasing sector numbers, wrapping to the lowest when there are
+ * none. Requests from many threads can be waiting at once, and ones
+ * for adjacent runs go back to back.
  */
 
 #include <types.h>
@@ -37,6 +48,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,15 +108,120 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * A request: NSECT sectors from SECTOR, to or from BUF in the kernel.
+ * It lives on the requester's stack until FINISHED is set.
+ */
+struct lhd_request {
+	uint32_t lr_sector;
+	uint32_t lr_nsect;
+	uint32_t lr_done;		/* sectors transferred so far */
+	bool lr_write;
+	char *lr_buf;
+	int lr_result;
+	bool lr_finished;
+	struct lhd_request *lr_next;	/* in lh_queue */
+};
+
+/*
+ * Start the disk on the next sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct lhd_request *lr = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lr != NULL && lr->lr_done < lr->lr_nsect);
+
+	/* If writing, transfer the data to the on-card buffer. */
+	if (lr->lr_write) {
+		memcpy(lh->lh_buf, lr->lr_buf + lr->lr_done * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lh->lh_headpos = lr->lr_sector + lr->lr_done;
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_headpos);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start the next waiting request, in C-SCAN
+ * order. The queue is kept sorted by sector, so that is the first
+ * one at or past the head, or else the first one.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_request *lr, **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			break;
+		}
+	}
+	if (*pp == NULL) {
+		/* Nothing further along; sweep again from the start */
+		pp = &lh->lh_queue;
+	}
+	lr = *pp;
+	*pp = lr->lr_next;
+	lr->lr_next = NULL;
+
+	lh->lh_active = lr;
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector has completed: move it out of the card if
+ * reading, and go on to the next sector, or if the request is done
+ * (or failed) wake its requester and start the next request.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_request *lr = lh->lh_active;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lr == NULL) {
+		kprintf("lhd%d: Spurious completion\n", lh->lh_unit);
+		return;
+	}
+
+	if (err == 0) {
+		if (!lr->lr_write) {
+			membar_load_load();
+			memcpy(lr->lr_buf + lr->lr_done * LHD_SECTSIZE,
+			       lh->lh_buf, LHD_SECTSIZE);
+		}
+		lr->lr_done++;
+		if (lr->lr_done < lr->lr_nsect) {
+			lhd_startsector(lh);
+			return;
+		}
+	}
+
+	lr->lr_result = err;
+	lr->lr_finished = true;
+	lh->lh_active = NULL;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+
+	lhd_start(lh);
 }
 
 /*
@@ -128,7 +245,9 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
+		spinlock_acquire(&lh->lh_lock);
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		spinlock_release(&lh->lh_lock);
 		break;
 	}
 }
@@ -179,21 +298,61 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request and wait for the interrupt handler to finish it.
+ */
+static
+int
+lhd_transfer(struct lhd_softc *lh, struct lhd_request *lr)
+{
+	struct lhd_request **pp;
+
+	lr->lr_done = 0;
+	lr->lr_result = 0;
+	lr->lr_finished = false;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Insert in sector order */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > lr->lr_sector) {
+			break;
+		}
+	}
+	lr->lr_next = *pp;
+	*pp = lr;
+
+	lhd_start(lh);
+	while (!lr->lr_finished) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	return lr->lr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A kernel uio with one buffer is transferred in place. Anything
+ * else goes through a bounce buffer, because the interrupt handler
+ * can't touch user memory.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct lhd_request lr;
+	struct iovec *iov;
+	char *bounce = NULL;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	size_t nbytes;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -207,61 +366,52 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
+	nbytes = len * LHD_SECTSIZE;
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	lr.lr_sector = sector;
+	lr.lr_nsect = len;
+	lr.lr_write = (uio->uio_rw == UIO_WRITE);
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == nbytes) {
+		lr.lr_buf = iov->iov_kbase;
+	}
+	else {
+		bounce = kmalloc(nbytes);
+		if (bounce == NULL) {
+			return ENOMEM;
+		}
+		if (lr.lr_write) {
+			result = uiomove(bounce, nbytes, uio);
 			if (result) {
-				V(lh->lh_clear);
+				kfree(bounce);
 				return result;
 			}
 		}
+		lr.lr_buf = bounce;
+	}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	result = lhd_transfer(lh, &lr);
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+	if (bounce == NULL) {
+		/* Account for the in-place transfer as uiomove would */
+		iov->iov_kbase = (char *)iov->iov_kbase + nbytes;
+		iov->iov_len = 0;
+		uio->uio_offset += nbytes;
+		uio->uio_resid = 0;
+	}
+	else {
+		if (result == 0 && !lr.lr_write) {
+			result = uiomove(bounce, nbytes, uio);
 		}
+		kfree(bounce);
 	}
 
-	return 0;
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
@@ -284,17 +434,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -30,6 +30,9 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+struct lhd_request;	/* Opaque; private to lhd.c */
+
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +54,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* Where requesters wait */
+	struct lhd_request *lh_queue;	/* Waiting requests, by sector */
+	struct lhd_request *lh_active;	/* Request the disk is doing */
+	uint32_t lh_headpos;		/* Last sector started */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -86,6 +86,7 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	sfs_bforget(sfs, diskblock);
 }
 
 /*
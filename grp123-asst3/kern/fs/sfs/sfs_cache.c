@@ -0,0 +1,654 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ *
+ * Every block SFS reads or writes goes through a fixed pool of
+ * block-sized buffers, found by (device, block) in a hash table and
+ * recycled least-recently-used first. Writes only mark the buffer
+ * dirty; it goes to disk when it is evicted, when the volume is
+ * synced (sfs_sync, fsync, unmount), or when the syncer thread finds
+ * it has been dirty too long or too many buffers are dirty. Dirty
+ * blocks that are adjacent on disk are written in one transfer.
+ *
+ * The cache is global and, like the rest of SFS, protected by
+ * vfs_biglock. Because the biglock is recursive, a page fault taken
+ * while copying to or from a buffer can come back into SFS and look
+ * for a buffer of its own; buffers handed out are therefore held busy
+ * until released and are never picked for eviction.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_NBUF      128  /* buffers in the cache */
+#define SFS_NBUCKETS  64   /* hash chains; must be a power of 2 */
+#define SFS_WB_RUN    16   /* most blocks written in one transfer */
+#define SFS_WB_AGE    5    /* seconds a buffer may stay dirty */
+#define SFS_WB_HIGH   (SFS_NBUF / 2)  /* more dirty than this ... */
+#define SFS_WB_LOW    (SFS_NBUF / 4)  /* ... and write back down to this */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;            /* volume the block belongs to */
+	struct device *b_dev;           /* device, for lookups */
+	daddr_t b_block;                /* block number on the device */
+	bool b_valid;                   /* on a hash chain, data is good */
+	bool b_dirty;                   /* needs writing back */
+	time_t b_dirtied;               /* when it last became dirty */
+	bool b_ahead;                   /* read ahead, not yet asked for */
+	unsigned b_busy;                /* holds by sfs_bget callers */
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lruprev;      /* toward most recently used */
+	struct sfs_buf *b_lrunext;      /* toward least recently used */
+	char *b_data;                   /* SFS_BLOCKSIZE bytes */
+};
+
+static struct sfs_buf sfs_bufs[SFS_NBUF];
+static char sfs_bufdata[SFS_NBUF][SFS_BLOCKSIZE];
+static struct sfs_buf *sfs_buckets[SFS_NBUCKETS];
+static struct sfs_buf *sfs_lruhead, *sfs_lrutail;
+static bool sfs_cache_ready;
+static unsigned sfs_ndirty;
+
+/* Buffers being written back, and where runs of them are put together */
+static struct sfs_buf *sfs_wblist[SFS_NBUF];
+static char sfs_wbdata[SFS_WB_RUN * SFS_BLOCKSIZE];
+
+static struct {
+	unsigned hits;
+	unsigned misses;
+	unsigned writebacks;
+	unsigned evictions;
+	unsigned syncer;
+	unsigned aheads;
+	unsigned aheadhits;
+} sfs_cachestats;
+
+#define SFS_BUCKET(dev, block) \
+	((((uintptr_t)(dev) >> 4) ^ (block)) & (SFS_NBUCKETS - 1))
+
+/*
+ * Set up the buffers on first use; they all start out invalid at the
+ * cold end of the LRU list.
+ */
+static
+void
+sfs_cache_init(void)
+{
+	unsigned i;
+
+	sfs_ndirty = 0;
+	for (i=0; i<SFS_NBUF; i++) {
+		sfs_bufs[i].b_fs = NULL;
+		sfs_bufs[i].b_dev = NULL;
+		sfs_bufs[i].b_block = 0;
+		sfs_bufs[i].b_valid = false;
+		sfs_bufs[i].b_dirty = false;
+		sfs_bufs[i].b_ahead = false;
+		sfs_bufs[i].b_busy = 0;
+		sfs_bufs[i].b_hashnext = NULL;
+		sfs_bufs[i].b_lruprev = i > 0 ? &sfs_bufs[i-1] : NULL;
+		sfs_bufs[i].b_lrunext = i+1 < SFS_NBUF ? &sfs_bufs[i+1] : NULL;
+		sfs_bufs[i].b_data = sfs_bufdata[i];
+	}
+	for (i=0; i<SFS_NBUCKETS; i++) {
+		sfs_buckets[i] = NULL;
+	}
+	sfs_lruhead = &sfs_bufs[0];
+	sfs_lrutail = &sfs_bufs[SFS_NBUF-1];
+	sfs_cache_ready = true;
+}
+
+////////////////////////////////////////////////////////////
+// Lists
+
+static
+void
+sfs_lru_remove(struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		sfs_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		sfs_lrutail = buf->b_lruprev;
+	}
+	buf->b_lruprev = buf->b_lrunext = NULL;
+}
+
+static
+void
+sfs_lru_addhead(struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = sfs_lruhead;
+	if (sfs_lruhead != NULL) {
+		sfs_lruhead->b_lruprev = buf;
+	}
+	else {
+		sfs_lrutail = buf;
+	}
+	sfs_lruhead = buf;
+}
+
+static
+void
+sfs_lru_addtail(struct sfs_buf *buf)
+{
+	buf->b_lrunext = NULL;
+	buf->b_lruprev = sfs_lrutail;
+	if (sfs_lrutail != NULL) {
+		sfs_lrutail->b_lrunext = buf;
+	}
+	else {
+		sfs_lruhead = buf;
+	}
+	sfs_lrutail = buf;
+}
+
+static
+void
+sfs_hash_remove(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_buckets[SFS_BUCKET(buf->b_dev, buf->b_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = buf->b_hashnext;
+	buf->b_hashnext = NULL;
+}
+
+static
+struct sfs_buf *
+sfs_hash_find(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	buf = sfs_buckets[SFS_BUCKET(dev, block)];
+	while (buf != NULL) {
+		if (buf->b_dev == dev && buf->b_block == block) {
+			return buf;
+		}
+		buf = buf->b_hashnext;
+	}
+	return NULL;
+}
+
+/*
+ * Mark a buffer clean, keeping count of the dirty ones.
+ */
+static
+void
+sfs_buf_clean(struct sfs_buf *buf)
+{
+	if (buf->b_dirty) {
+		KASSERT(sfs_ndirty > 0);
+		sfs_ndirty--;
+		buf->b_dirty = false;
+	}
+}
+
+/*
+ * Forget a buffer's identity and send it to the cold end of the LRU
+ * list so it is reused first. Dirty data is dropped.
+ */
+static
+void
+sfs_buf_invalidate(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_busy == 0);
+
+	if (buf->b_valid) {
+		sfs_hash_remove(buf);
+	}
+	sfs_buf_clean(buf);
+	buf->b_valid = false;
+	buf->b_ahead = false;
+	buf->b_fs = NULL;
+	buf->b_dev = NULL;
+	sfs_lru_remove(buf);
+	sfs_lru_addtail(buf);
+}
+
+////////////////////////////////////////////////////////////
+// Write-back
+
+static
+int
+sfs_buf_write(struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(buf->b_valid && buf->b_dirty);
+
+	result = sfs_rawio(buf->b_fs, buf->b_block, buf->b_data, 1,
+			   UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	sfs_buf_clean(buf);
+	sfs_cachestats.writebacks++;
+	return 0;
+}
+
+/*
+ * Write back the N dirty buffers in sfs_wblist. They are sorted by
+ * block first, and each run of blocks adjacent on the same device
+ * goes out in one transfer.
+ */
+static
+int
+sfs_buf_writelist(unsigned n)
+{
+	struct sfs_buf *buf;
+	unsigned i, j, len;
+	int result;
+
+	/* Insertion sort; the list is short */
+	for (i=1; i<n; i++) {
+		buf = sfs_wblist[i];
+		for (j=i; j>0; j--) {
+			if (sfs_wblist[j-1]->b_dev < buf->b_dev ||
+			    (sfs_wblist[j-1]->b_dev == buf->b_dev &&
+			     sfs_wblist[j-1]->b_block < buf->b_block)) {
+				break;
+			}
+			sfs_wblist[j] = sfs_wblist[j-1];
+		}
+		sfs_wblist[j] = buf;
+	}
+
+	for (i=0; i<n; i += len) {
+		buf = sfs_wblist[i];
+		for (len = 1; i + len < n && len < SFS_WB_RUN; len++) {
+			if (sfs_wblist[i+len]->b_dev != buf->b_dev ||
+			    sfs_wblist[i+len]->b_block != buf->b_block + len) {
+				break;
+			}
+		}
+
+		if (len == 1) {
+			result = sfs_buf_write(buf);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		for (j=0; j<len; j++) {
+			memcpy(sfs_wbdata + j * SFS_BLOCKSIZE,
+			       sfs_wblist[i+j]->b_data, SFS_BLOCKSIZE);
+		}
+		result = sfs_rawio(buf->b_fs, buf->b_block, sfs_wbdata, len,
+				   UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		for (j=0; j<len; j++) {
+			sfs_buf_clean(sfs_wblist[i+j]);
+		}
+		sfs_cachestats.writebacks += len;
+	}
+	return 0;
+}
+
+/*
+ * Find a buffer to reuse: the least recently used one nobody holds,
+ * written back first if it is dirty.
+ */
+static
+int
+sfs_buf_evict(struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	for (buf = sfs_lrutail; buf != NULL; buf = buf->b_lruprev) {
+		if (buf->b_busy == 0) {
+			break;
+		}
+	}
+	if (buf == NULL) {
+		/* Every buffer is held; only deep fault recursion does this */
+		return ENOMEM;
+	}
+
+	if (buf->b_valid) {
+		if (buf->b_dirty) {
+			result = sfs_buf_write(buf);
+			if (result) {
+				return result;
+			}
+		}
+		sfs_hash_remove(buf);
+		buf->b_valid = false;
+		buf->b_fs = NULL;
+		buf->b_dev = NULL;
+		sfs_cachestats.evictions++;
+	}
+
+	*ret = buf;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+/*
+ * Get the buffer for BLOCK of SFS and hold it until sfs_brelse. If
+ * FILL is set, a block not in the cache is read in; otherwise it comes
+ * back zeroed, for callers about to overwrite all of it.
+ */
+int
+sfs_bget(struct sfs_fs *sfs, daddr_t block, bool fill, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(sfs->sfs_device != NULL);
+
+	if (!sfs_cache_ready) {
+		sfs_cache_init();
+	}
+
+	buf = sfs_hash_find(sfs->sfs_device, block);
+	if (buf != NULL) {
+		KASSERT(buf->b_fs == sfs);
+		sfs_cachestats.hits++;
+		if (buf->b_ahead) {
+			sfs_cachestats.aheadhits++;
+			buf->b_ahead = false;
+		}
+	}
+	else {
+		sfs_cachestats.misses++;
+
+		result = sfs_buf_evict(&buf);
+		if (result) {
+			return result;
+		}
+
+		if (fill) {
+			result = sfs_rawio(sfs, block, buf->b_data, 1, UIO_READ);
+			if (result) {
+				sfs_lru_remove(buf);
+				sfs_lru_addtail(buf);
+				return result;
+			}
+		}
+		else {
+			bzero(buf->b_data, SFS_BLOCKSIZE);
+		}
+
+		buf->b_fs = sfs;
+		buf->b_dev = sfs->sfs_device;
+		buf->b_block = block;
+		buf->b_valid = true;
+		buf->b_dirty = false;
+		buf->b_ahead = false;
+		buf->b_hashnext = sfs_buckets[SFS_BUCKET(buf->b_dev, block)];
+		sfs_buckets[SFS_BUCKET(buf->b_dev, block)] = buf;
+	}
+
+	buf->b_busy++;
+	sfs_lru_remove(buf);
+	sfs_lru_addhead(buf);
+
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * The block's data.
+ */
+void *
+sfs_bdata(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_busy > 0);
+	return buf->b_data;
+}
+
+/*
+ * Note that the caller changed the block, so it must be written back.
+ */
+void
+sfs_bdirty(struct sfs_buf *buf)
+{
+	struct timespec ts;
+
+	KASSERT(buf->b_busy > 0);
+	if (!buf->b_dirty) {
+		gettime(&ts);
+		buf->b_dirtied = ts.tv_sec;
+		buf->b_dirty = true;
+		sfs_ndirty++;
+	}
+}
+
+/*
+ * Let go of a buffer from sfs_bget.
+ */
+void
+sfs_brelse(struct sfs_buf *buf)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(buf->b_busy > 0);
+	buf->b_busy--;
+}
+
+/*
+ * BLOCK was freed; there is no point writing back what it held.
+ */
+void
+sfs_bforget(struct sfs_fs *sfs, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_cache_ready || sfs->sfs_device == NULL) {
+		return;
+	}
+	buf = sfs_hash_find(sfs->sfs_device, block);
+	if (buf == NULL) {
+		return;
+	}
+	if (buf->b_busy > 0) {
+		sfs_buf_clean(buf);
+		return;
+	}
+	sfs_buf_invalidate(buf);
+}
+
+/*
+ * Whether BLOCK is in the cache already.
+ */
+bool
+sfs_bcached(struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(vfs_biglock_do_i_hold());
+
+	return sfs_cache_ready &&
+		sfs_hash_find(sfs->sfs_device, block) != NULL;
+}
+
+/*
+ * Put a block read ahead into the cache, unless it is there already.
+ * It goes in at the hot end so that it survives until the reader
+ * catches up. Read-ahead is only a hint, so if no buffer can be had
+ * the data is dropped.
+ */
+void
+sfs_bprefill(struct sfs_fs *sfs, daddr_t block, const void *data)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_cache_ready) {
+		sfs_cache_init();
+	}
+	if (sfs_hash_find(sfs->sfs_device, block) != NULL) {
+		return;
+	}
+	if (sfs_buf_evict(&buf)) {
+		return;
+	}
+
+	memcpy(buf->b_data, data, SFS_BLOCKSIZE);
+	buf->b_fs = sfs;
+	buf->b_dev = sfs->sfs_device;
+	buf->b_block = block;
+	buf->b_valid = true;
+	buf->b_dirty = false;
+	buf->b_ahead = true;
+	buf->b_hashnext = sfs_buckets[SFS_BUCKET(buf->b_dev, block)];
+	sfs_buckets[SFS_BUCKET(buf->b_dev, block)] = buf;
+	sfs_lru_remove(buf);
+	sfs_lru_addhead(buf);
+	sfs_cachestats.aheads++;
+}
+
+/*
+ * Write back every dirty buffer of SFS.
+ */
+int
+sfs_cache_flush(struct sfs_fs *sfs)
+{
+	unsigned i, n;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_cache_ready) {
+		return 0;
+	}
+	n = 0;
+	for (i=0; i<SFS_NBUF; i++) {
+		if (sfs_bufs[i].b_fs == sfs && sfs_bufs[i].b_dirty) {
+			sfs_wblist[n++] = &sfs_bufs[i];
+		}
+	}
+	return sfs_buf_writelist(n);
+}
+
+/*
+ * The syncer's part: write back buffers that have been dirty for
+ * SFS_WB_AGE seconds, and if more than SFS_WB_HIGH are dirty, the
+ * oldest of the rest until only SFS_WB_LOW are left.
+ */
+int
+sfs_cache_writeback(void)
+{
+	struct timespec ts;
+	struct sfs_buf *buf;
+	unsigned i, n, excess;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_cache_ready || sfs_ndirty == 0) {
+		return 0;
+	}
+	gettime(&ts);
+
+	n = 0;
+	for (i=0; i<SFS_NBUF; i++) {
+		if (sfs_bufs[i].b_dirty &&
+		    ts.tv_sec - sfs_bufs[i].b_dirtied >= SFS_WB_AGE) {
+			sfs_wblist[n++] = &sfs_bufs[i];
+		}
+	}
+
+	/* Least recently used first is close enough to oldest first */
+	excess = sfs_ndirty - n > SFS_WB_HIGH ? sfs_ndirty - n - SFS_WB_LOW : 0;
+	for (buf = sfs_lrutail; buf != NULL && excess > 0;
+	     buf = buf->b_lruprev) {
+		if (buf->b_dirty &&
+		    ts.tv_sec - buf->b_dirtied < SFS_WB_AGE) {
+			sfs_wblist[n++] = buf;
+			excess--;
+		}
+	}
+
+	result = sfs_buf_writelist(n);
+	if (result == 0) {
+		sfs_cachestats.syncer += n;
+	}
+	return result;
+}
+
+/*
+ * Drop every buffer of SFS, dirty or not. Used when the volume goes
+ * away, after it has been flushed.
+ */
+void
+sfs_cache_invalidate(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (!sfs_cache_ready) {
+		return;
+	}
+	for (i=0; i<SFS_NBUF; i++) {
+		if (sfs_bufs[i].b_fs == sfs) {
+			sfs_buf_invalidate(&sfs_bufs[i]);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Statistics
+
+void
+sfs_cache_printstats(void)
+{
+	unsigned lookups;
+
+	vfs_biglock_acquire();
+
+	lookups = sfs_cachestats.hits + sfs_cachestats.misses;
+
+	kprintf("SFS buffer cache: %u buffers of %u bytes, %u dirty\n",
+		SFS_NBUF, SFS_BLOCKSIZE, sfs_ndirty);
+	kprintf("    %u hits, %u misses (%u%% hit rate)\n",
+		sfs_cachestats.hits, sfs_cachestats.misses,
+		lookups ? sfs_cachestats.hits * 100 / lookups : 0);
+	kprintf("    %u evictions, %u blocks written back, "
+		"%u of them by the syncer\n",
+		sfs_cachestats.evictions, sfs_cachestats.writebacks,
+		sfs_cachestats.syncer);
+	kprintf("    %u blocks read ahead, %u of them used\n",
+		sfs_cachestats.aheads, sfs_cachestats.aheadhits);
+
+	vfs_biglock_release();
+}
+
+void
+sfs_cache_resetstats(void)
+{
+	vfs_biglock_acquire();
+	sfs_cachestats.hits = 0;
+	sfs_cachestats.misses = 0;
+	sfs_cachestats.writebacks = 0;
+	sfs_cachestats.evictions = 0;
+	sfs_cachestats.syncer = 0;
+	sfs_cachestats.aheads = 0;
+	sfs_cachestats.aheadhits = 0;
+	vfs_biglock_release();
+}
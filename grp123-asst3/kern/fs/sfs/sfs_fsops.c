@@ -106,7 +106,9 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 }
 
 /*
- * Sync routine for the vnode table.
+ * Sync routine for the vnode table. This writes the inodes into the
+ * buffer cache; it is up to the caller to flush that. (VOP_FSYNC
+ * would flush the whole cache for every vnode.)
  */
 static
 int
@@ -118,7 +120,7 @@ sfs_sync_vnodes(struct sfs_fs *sfs)
 	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		sfs_sync_inode(v->vn_data);
 	}
 	return 0;
 }
@@ -163,6 +165,34 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 	return 0;
 }
 
+/*
+ * Write the dirty in-memory metadata of the volume - inodes, the
+ * free block map and the superblock - into the buffer cache. Used by
+ * sfs_sync and by the syncer thread.
+ */
+int
+sfs_sync_meta(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* If any vnodes need to be written, write them. */
+	result = sfs_sync_vnodes(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* If the free block map needs to be written, write it. */
+	result = sfs_sync_freemap(sfs);
+	if (result) {
+		return result;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	return sfs_sync_superblock(sfs);
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -208,22 +238,15 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* If any vnodes need to be written, write them. */
-	result = sfs_sync_vnodes(sfs);
+	/* Get the in-memory metadata into the buffer cache... */
+	result = sfs_sync_meta(sfs);
 	if (result) {
 		vfs_biglock_release();
 		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	result = sfs_sync_freemap(sfs);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
-
-	/* If the superblock needs to be written, write it. */
-	result = sfs_sync_superblock(sfs);
+	/* ...and write everything out. */
+	result = sfs_cache_flush(sfs);
 	if (result) {
 		vfs_biglock_release();
 		return result;
@@ -262,6 +285,8 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
+	sfs_writeback_remove(sfs);
+	sfs_cache_invalidate(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
@@ -277,6 +302,7 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 
@@ -290,6 +316,13 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* ...but make sure nothing is left in the buffer cache. */
+	result = sfs_cache_flush(sfs);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -321,6 +354,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -355,11 +389,17 @@ sfs_fs_create(void)
 	if (sfs->sfs_vnodes == NULL) {
 		goto cleanup_object;
 	}
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
 
+	/* not on the syncer's list until mounted */
+	sfs->sfs_wbnext = NULL;
+
 	return sfs;
 
 cleanup_object:
@@ -464,6 +504,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
+	/* Reads on this volume can now be read ahead */
+	sfs_readahead_start();
+
+	/* and the syncer can write back what changes */
+	sfs_writeback_add(sfs);
+
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
@@ -70,7 +70,9 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **pp;
+	struct vnode *last;
+	unsigned num;
 	int result;
 
 	vfs_biglock_acquire();
@@ -114,22 +116,25 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	/* Remove the vnode structure from the hash in the struct sfs_fs... */
+	pp = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
+		pp = &(*pp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*pp = sv->sv_hashnext;
+
+	/* ...and from the table, moving the last entry into its slot. */
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) == v);
+	last = vnodearray_get(sfs->sfs_vnodes, num - 1);
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_index, last);
+	((struct sfs_vnode *)last->vn_data)->sv_index = sv->sv_index;
+	vnodearray_remove(sfs->sfs_vnodes, num - 1);
 
 	vnode_cleanup(&sv->sv_absvn);
 
@@ -150,29 +155,24 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
+	/* Look in the vnodes table, by inode number */
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
 
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in unallocated "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+
 			/* forcetype is only allowed when creating objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
@@ -205,6 +205,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet; one from the start counts as sequential */
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -242,13 +247,15 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
+	/* Add it to our table, and to the hash */
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, &sv->sv_index);
 	if (result) {
 		vnode_cleanup(&sv->sv_absvn);
 		kfree(sv);
 		return result;
 	}
+	sv->sv_hashnext = sfs->sfs_vnhash[SFS_VNHASH(ino)];
+	sfs->sfs_vnhash[SFS_VNHASH(ino)] = sv;
 
 	/* Hand it back */
 	*ret = sv;
@@ -102,33 +102,62 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 }
 
 /*
- * Read a block.
+ * Transfer NBLOCKS consecutive blocks starting at BLOCK between the
+ * device and DATA, bypassing the buffer cache. Only the cache and
+ * read-ahead should use this.
  */
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_rawio(struct sfs_fs *sfs, daddr_t block, void *data, unsigned nblocks,
+	  enum uio_rw rw)
 {
 	struct iovec iov;
 	struct uio ku;
 
+	uio_kinit(&iov, &ku, data, nblocks * SFS_BLOCKSIZE,
+		  ((off_t)block) * SFS_BLOCKSIZE, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Read a block, through the buffer cache.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, sfs_bdata(buf), len);
+	sfs_brelse(buf);
+	return 0;
 }
 
 /*
- * Write a block.
+ * Write a block. This only updates the buffer cache; the block goes
+ * to disk when its buffer is evicted or the volume is synced.
  */
 int
 sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(sfs_bdata(buf), data, len);
+	sfs_bdirty(buf);
+	sfs_brelse(buf);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -136,10 +165,9 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 // File-level I/O
 
 /*
- * Do I/O to a block of a file that doesn't cover the whole block.  We
- * need to read in the original block first, even if we're writing, so
- * we don't clobber the portion of the block we're not intending to
- * write over.
+ * Do I/O to a block of a file that doesn't cover the whole block. The
+ * block's buffer is read in first, even if we're writing, so we don't
+ * clobber the portion of the block we're not intending to write over.
  *
  * SKIPSTART is the number of bytes to skip past at the beginning of
  * the sector; LEN is the number of bytes to actually read or write.
@@ -150,16 +178,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,9 +189,6 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
@@ -184,58 +201,49 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It reads as zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
-	/*
-	 * Now perform the requested operation into/out of the buffer.
-	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bget(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer was read in first, so it holds
+	 * the block (even if the copy failed partway) and must be
+	 * written back. sfs_blockio cannot say the same.
 	 */
+	result = uiomove((char *)sfs_bdata(buf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(buf);
 	}
+	sfs_brelse(buf);
 
-	return 0;
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block. A block
+ * being overwritten completely is not read in first, so if the copy
+ * fails partway a buffer that came back zeroed holds neither the old
+ * block nor the new one, and is thrown away rather than written back.
  */
 static
 int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool cached;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -257,30 +265,23 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
-
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
 
-	result = sfs_rwblock(sfs, uio);
+	cached = sfs_bcached(sfs, diskblock);
+	result = sfs_bget(sfs, diskblock, uio->uio_rw == UIO_READ, &buf);
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(sfs_bdata(buf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE && (result == 0 || cached)) {
+		/* a cached block failing partway is like sfs_partialio */
+		sfs_bdirty(buf);
+	}
+	sfs_brelse(buf);
+	if (uio->uio_rw == UIO_WRITE && result && !cached) {
+		sfs_bforget(sfs, diskblock);
+	}
 
 	return result;
 }
@@ -317,6 +318,9 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/* Get the blocks after this read on the way */
+		sfs_readahead(sv, uio);
 	}
 
 	/*
@@ -407,6 +411,7 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	   enum uio_rw rw)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	off_t endpos;
 	uint32_t vnblock;
 	uint32_t blockoffset;
@@ -414,16 +419,6 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
 	KASSERT(vfs_biglock_do_i_hold());
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
@@ -446,26 +441,21 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	result = sfs_bget(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, (char *)sfs_bdata(buf) + blockoffset, len);
+		sfs_brelse(buf);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it goes out with the buffer */
+		memcpy((char *)sfs_bdata(buf) + blockoffset, data, len);
+		sfs_bdirty(buf);
+		sfs_brelse(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
@@ -0,0 +1,276 @@
+/*
+ * SFS filesystem
+ *
+ * Sequential read-ahead.
+ *
+ * Each vnode remembers where its last read ended. A read that starts
+ * there is sequential, and doubles the vnode's read-ahead window (up
+ * to sfs_readahead_max()); any other read resets it. Sequential reads
+ * queue the blocks in the window past the read for the read-ahead
+ * thread, which brings them into the buffer cache, a run of adjacent
+ * disk blocks at a time, while the reader is off doing something
+ * else. The reader finds them in the cache or, if it gets there first,
+ * waits on vfs_biglock for the transfer in progress.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_RA_MIN    4    /* window after the first sequential read */
+#define SFS_RA_LIMIT  64   /* largest window that can be set */
+#define SFS_RA_QUEUE  16   /* outstanding requests */
+
+struct sfs_ra_request {
+	struct sfs_vnode *sv;           /* referenced while queued */
+	uint32_t fileblock;             /* first block of the file to read */
+	unsigned nblocks;
+};
+
+static unsigned sfs_ra_max = 32;
+
+static struct lock *sfs_ra_lock;        /* protects the queue */
+static struct cv *sfs_ra_cv;            /* signalled when queue not empty */
+static struct sfs_ra_request sfs_ra_queue[SFS_RA_QUEUE];
+static unsigned sfs_ra_head, sfs_ra_count;
+static bool sfs_ra_running;
+
+/* Where runs are read; only the read-ahead thread uses it */
+static char sfs_ra_buf[SFS_RA_LIMIT * SFS_BLOCKSIZE];
+
+unsigned
+sfs_readahead_max(void)
+{
+	return sfs_ra_max;
+}
+
+void
+sfs_readahead_setmax(unsigned nblocks)
+{
+	sfs_ra_max = nblocks > SFS_RA_LIMIT ? SFS_RA_LIMIT : nblocks;
+}
+
+/*
+ * Read the run of NBLOCKS disk blocks starting at DISKBLOCK and hand
+ * them to the cache.
+ */
+static
+int
+sfs_ra_readrun(struct sfs_fs *sfs, daddr_t diskblock, unsigned nblocks)
+{
+	unsigned i;
+	int result;
+
+	if (nblocks == 0) {
+		return 0;
+	}
+	result = sfs_rawio(sfs, diskblock, sfs_ra_buf, nblocks, UIO_READ);
+	if (result) {
+		return result;
+	}
+	for (i=0; i<nblocks; i++) {
+		sfs_bprefill(sfs, diskblock + i,
+			     sfs_ra_buf + i * SFS_BLOCKSIZE);
+	}
+	return 0;
+}
+
+/*
+ * Bring in the blocks of a request that aren't cached yet, gathering
+ * blocks that are adjacent on disk into one transfer. Errors just end
+ * the request; the reader will run into them itself.
+ */
+static
+void
+sfs_ra_fetch(struct sfs_ra_request *req)
+{
+	struct sfs_vnode *sv = req->sv;
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t fileblock, end, fileblocks;
+	daddr_t diskblock, runstart = 0;
+	unsigned runlen = 0;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	/* The file may have shrunk since the request was queued */
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	end = req->fileblock + req->nblocks;
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+
+	for (fileblock = req->fileblock; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock == 0 || sfs_bcached(sfs, diskblock)) {
+			/* Hole or already here; ends the run */
+			if (sfs_ra_readrun(sfs, runstart, runlen)) {
+				return;
+			}
+			runlen = 0;
+			continue;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen &&
+		    runlen < SFS_RA_LIMIT) {
+			runlen++;
+			continue;
+		}
+		if (sfs_ra_readrun(sfs, runstart, runlen)) {
+			return;
+		}
+		runstart = diskblock;
+		runlen = 1;
+	}
+	sfs_ra_readrun(sfs, runstart, runlen);
+}
+
+static
+void
+sfs_ra_thread(void *data1, unsigned long data2)
+{
+	struct sfs_ra_request req;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		lock_acquire(sfs_ra_lock);
+		while (sfs_ra_count == 0) {
+			cv_wait(sfs_ra_cv, sfs_ra_lock);
+		}
+		req = sfs_ra_queue[sfs_ra_head];
+		sfs_ra_head = (sfs_ra_head + 1) % SFS_RA_QUEUE;
+		sfs_ra_count--;
+		lock_release(sfs_ra_lock);
+
+		vfs_biglock_acquire();
+		sfs_ra_fetch(&req);
+		vfs_biglock_release();
+
+		/* May reclaim the vnode, which takes the biglock itself */
+		VOP_DECREF(&req.sv->sv_absvn);
+	}
+}
+
+/*
+ * Start the read-ahead thread, on the first mount. Without it reads
+ * just aren't read ahead.
+ */
+void
+sfs_readahead_start(void)
+{
+	int result;
+
+	if (sfs_ra_running) {
+		return;
+	}
+
+	sfs_ra_lock = lock_create("sfs readahead");
+	if (sfs_ra_lock == NULL) {
+		kprintf("sfs: no read-ahead: out of memory\n");
+		return;
+	}
+	sfs_ra_cv = cv_create("sfs readahead");
+	if (sfs_ra_cv == NULL) {
+		lock_destroy(sfs_ra_lock);
+		kprintf("sfs: no read-ahead: out of memory\n");
+		return;
+	}
+
+	result = thread_fork("sfs readahead", NULL, sfs_ra_thread, NULL, 0);
+	if (result) {
+		cv_destroy(sfs_ra_cv);
+		lock_destroy(sfs_ra_lock);
+		kprintf("sfs: no read-ahead: %s\n", strerror(result));
+		return;
+	}
+	sfs_ra_running = true;
+}
+
+/*
+ * Queue a request for the read-ahead thread. Returns false if it
+ * couldn't be queued.
+ */
+static
+bool
+sfs_ra_enqueue(struct sfs_vnode *sv, uint32_t fileblock, unsigned nblocks)
+{
+	struct sfs_ra_request *req;
+
+	if (!sfs_ra_running) {
+		return false;
+	}
+
+	lock_acquire(sfs_ra_lock);
+	if (sfs_ra_count == SFS_RA_QUEUE) {
+		lock_release(sfs_ra_lock);
+		return false;
+	}
+	req = &sfs_ra_queue[(sfs_ra_head + sfs_ra_count) % SFS_RA_QUEUE];
+	req->sv = sv;
+	req->fileblock = fileblock;
+	req->nblocks = nblocks;
+	VOP_INCREF(&sv->sv_absvn);
+	sfs_ra_count++;
+	cv_signal(sfs_ra_cv, sfs_ra_lock);
+	lock_release(sfs_ra_lock);
+
+	return true;
+}
+
+/*
+ * Called by sfs_io before a read of UIO from SV. Updates the vnode's
+ * window and, once the reader has used up half of what was read
+ * ahead, queues the rest of the window.
+ */
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio *uio)
+{
+	uint32_t first, last, start, end, fileblocks;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+
+	if (uio->uio_resid == 0) {
+		return;
+	}
+	first = uio->uio_offset / SFS_BLOCKSIZE;
+	last = (uio->uio_offset + uio->uio_resid - 1) / SFS_BLOCKSIZE;
+
+	/* Sequential if it picks up where the last read stopped */
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		sv->sv_rawindow = sv->sv_rawindow == 0 ?
+			SFS_RA_MIN : sv->sv_rawindow * 2;
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+	}
+	if (sv->sv_rawindow > sfs_ra_max) {
+		sv->sv_rawindow = sfs_ra_max;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	start = sv->sv_raend > last + 1 ? sv->sv_raend : last + 1;
+	end = last + 1 + sv->sv_rawindow;
+	if (end > fileblocks) {
+		end = fileblocks;
+	}
+	if (start >= end || start - (last + 1) > sv->sv_rawindow / 2) {
+		return;
+	}
+
+	if (sfs_ra_enqueue(sv, start, end - start)) {
+		sv->sv_raend = end;
+	}
+}
@@ -226,6 +226,13 @@ sfs_fsync(struct vnode *v)
 
 	vfs_biglock_acquire();
 	result = sfs_sync_inode(sv);
+	if (result == 0) {
+		/*
+		 * The cache doesn't know which blocks are this file's,
+		 * so write back everything dirty on the volume.
+		 */
+		result = sfs_cache_flush(sv->sv_absvn.vn_fs->fs_data);
+	}
 	vfs_biglock_release();
 
 	return result;
@@ -238,8 +245,12 @@ static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
+	/*
+	 * Mapped pages are read and written back through VOP_READ and
+	 * VOP_WRITE, so any regular file can be mapped.
+	 */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -0,0 +1,100 @@
+/*
+ * SFS filesystem
+ *
+ * Syncer thread.
+ *
+ * Once a second the syncer copies dirty inodes, free block maps and
+ * superblocks of every mounted volume into the buffer cache, and then
+ * writes back the buffers that have been dirty too long or that put
+ * the cache over its dirty limit (sfs_cache_writeback). So writes
+ * only ever wait for the disk when they have to evict a dirty buffer;
+ * sync and fsync still write everything out before returning.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_WB_INTERVAL  1   /* seconds between passes */
+
+/* Mounted volumes; protected by vfs_biglock */
+static struct sfs_fs *sfs_wb_volumes;
+static bool sfs_wb_running;
+
+static
+void
+sfs_wb_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs;
+	int result;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_WB_INTERVAL);
+
+		vfs_biglock_acquire();
+		for (sfs = sfs_wb_volumes; sfs != NULL; sfs = sfs->sfs_wbnext) {
+			result = sfs_sync_meta(sfs);
+			if (result) {
+				kprintf("sfs: %s: syncer: %s\n",
+					sfs->sfs_sb.sb_volname,
+					strerror(result));
+			}
+		}
+		result = sfs_cache_writeback();
+		if (result) {
+			kprintf("sfs: syncer: %s\n", strerror(result));
+		}
+		vfs_biglock_release();
+	}
+}
+
+/*
+ * Add a newly mounted volume to the syncer's list, starting the
+ * syncer on the first mount. Without it, dirty buffers wait for
+ * eviction or an explicit sync.
+ */
+void
+sfs_writeback_add(struct sfs_fs *sfs)
+{
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	sfs->sfs_wbnext = sfs_wb_volumes;
+	sfs_wb_volumes = sfs;
+
+	if (!sfs_wb_running) {
+		result = thread_fork("sfs syncer", NULL, sfs_wb_thread,
+				     NULL, 0);
+		if (result) {
+			kprintf("sfs: no syncer: %s\n", strerror(result));
+			return;
+		}
+		sfs_wb_running = true;
+	}
+}
+
+/*
+ * Take a volume off the list, if it is on it.
+ */
+void
+sfs_writeback_remove(struct sfs_fs *sfs)
+{
+	struct sfs_fs **pp;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	for (pp = &sfs_wb_volumes; *pp != NULL; pp = &(*pp)->sfs_wbnext) {
+		if (*pp == sfs) {
+			*pp = sfs->sfs_wbnext;
+			sfs->sfs_wbnext = NULL;
+			return;
+		}
+	}
+}
@@ -52,6 +52,20 @@ int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
+/* Functions in sfs_cache.c */
+struct sfs_buf;
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, bool fill,
+		struct sfs_buf **ret);
+void *sfs_bdata(struct sfs_buf *buf);
+void sfs_bdirty(struct sfs_buf *buf);
+void sfs_brelse(struct sfs_buf *buf);
+void sfs_bforget(struct sfs_fs *sfs, daddr_t block);
+bool sfs_bcached(struct sfs_fs *sfs, daddr_t block);
+void sfs_bprefill(struct sfs_fs *sfs, daddr_t block, const void *data);
+int sfs_cache_flush(struct sfs_fs *sfs);
+int sfs_cache_writeback(void);
+void sfs_cache_invalidate(struct sfs_fs *sfs);
+
 /* Functions in sfs_dir.c */
 int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		uint32_t *ino, int *slot, int *emptyslot);
@@ -62,6 +76,9 @@ int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
 
+/* Functions in sfs_fsops.c */
+int sfs_sync_meta(struct sfs_fs *sfs);
+
 /* Functions in sfs_inode.c */
 int sfs_sync_inode(struct sfs_vnode *sv);
 int sfs_reclaim(struct vnode *v);
@@ -71,11 +88,21 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_rawio(struct sfs_fs *sfs, daddr_t block, void *data, unsigned nblocks,
+	      enum uio_rw rw);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_readahead.c */
+void sfs_readahead_start(void);
+void sfs_readahead(struct sfs_vnode *sv, struct uio *uio);
+
+/* Functions in sfs_writeback.c */
+void sfs_writeback_add(struct sfs_fs *sfs);
+void sfs_writeback_remove(struct sfs_fs *sfs);
+
 
 #endif /* _SFSPRIVATE_H_ */
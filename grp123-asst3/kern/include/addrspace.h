@@ -56,9 +56,71 @@ struct as_region {
         int executable;
         int loading;
         vaddr_t vbase; 
+
+        /*
+         * File-backed regions (ELF segments): the first FILESIZE
+         * bytes of the region come from VN at FILE_OFFSET and are
+         * read in on first touch; the rest is zero-filled. VN is
+         * NULL for anonymous regions.
+         */
+        struct vnode *vn;
+        off_t file_offset;
+        size_t filesize;
+
+        /*
+         * Regions made by mmap() can be unmapped. In a shared one,
+         * pages written while mapped are written back to VN by
+         * munmap() and at exit; TLBLO_DIRTY marks them.
+         */
+        int mapped;
+        int shared;
 };
 
 
+/*
+ * Page table: three levels, sized so every table is a kmalloc
+ * subpage block and a small process needs only a few of them.
+ *
+ *    va bits 31..26  (top, 32 entries, in struct addrspace)
+ *    va bits 25..20  (directory, 64 leaves of 1MB each, struct pt_dir)
+ *    va bits 19..12  (leaf, 256 PTEs = 1KB)
+ *
+ * User addresses are below 2GB, so bit 31 is always 0. Directories
+ * and leaves are allocated on first use. Each directory counts the
+ * entries in use in its leaves, so that a leaf can be freed when it
+ * empties and teardown can skip what was never mapped.
+ */
+#define PT_TOP_SIZE   32
+#define PT_DIR_SIZE   64
+#define PT_LEAF_SIZE  256
+#define PT_TOP(va)    ((va) >> 26)
+#define PT_DIR(va)    (((va) >> 20) & (PT_DIR_SIZE - 1))
+#define PT_LEAF(va)   (((va) >> 12) & (PT_LEAF_SIZE - 1))
+#define PT_LEAF_SPAN  (PT_LEAF_SIZE * PAGE_SIZE) /* bytes a leaf maps */
+#define PT_VADDR(top, dir, leaf) \
+        (((vaddr_t)(top) << 26) | ((dir) << 20) | ((leaf) << 12))
+
+struct pt_dir {
+        paddr_t *leaf[PT_DIR_SIZE];
+        uint16_t npages[PT_DIR_SIZE]; /* nonzero entries in each leaf */
+};
+
+/*
+ * The stack region starts as one page below USERSTACK and grows
+ * down on fault, up to the stack limit (vm_stacklimit()). It never
+ * comes within STACK_GUARD bytes of the heap, nor the heap within
+ * STACK_GUARD of it, so running off either end faults.
+ */
+#define STACK_GUARD (16 * PAGE_SIZE)
+
+#define TLBCACHE_SIZE 64 /* must be a power of 2 */
+#define TLBCACHE_INDEX(vaddr) (((vaddr) >> 12) & (TLBCACHE_SIZE - 1))
+
+struct tlbcache_entry {
+        vaddr_t vpage; /* 0 if empty; page 0 is never mapped */
+        paddr_t pte;
+};
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -71,7 +133,18 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         struct as_region *head;
-        paddr_t **pagetable;
+        struct as_region *heap; /* sbrk region, one of those on head */
+        struct as_region *stack; /* stack region, likewise */
+        struct pt_dir *pagetable[PT_TOP_SIZE];
+        size_t pt_bytes; /* memory used by directories and leaves */
+        struct tlbcache_entry tlbcache[TLBCACHE_SIZE];
+        uint32_t asid; /* TLB address space ID ... */
+        uint32_t asid_generation; /* ... valid in this generation */
+        vaddr_t fault_last; /* page of the last TLB miss ... */
+        unsigned fault_run; /* ... and how many came in ascending order */
+        unsigned rss; /* resident pages, not counting the zero page */
+        size_t vsize; /* bytes spanned by the regions, in whole pages */
+        vaddr_t rss_hand; /* where the RSS-limit clock looks next */
 
 #endif
 };
@@ -113,6 +186,25 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_map_file - back the region starting at VADDR with FILESIZE
+ *                bytes of vnode V from OFFSET. Pages are read in
+ *                when first touched rather than at load time.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand
+ *                back the old end. Pages are allocated when touched
+ *                and freed when the heap shrinks past them.
+ *
+ *    as_mmap   - map LENGTH bytes of vnode V from OFFSET (or zeros if
+ *                V is NULL) somewhere free below the stack. Writable
+ *                file mappings are shared with the file.
+ *
+ *    as_munmap - remove the mapping starting at VADDR, writing back
+ *                what was changed if it is shared.
+ *
+ *    as_vsize  - virtual size of the address space: the bytes of all
+ *                its regions, in whole pages. Kept as a count so it
+ *                can be read without the region list (ps).
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -131,6 +223,15 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_map_file(struct addrspace *as, vaddr_t vaddr,
+                              struct vnode *v, off_t offset,
+                              size_t filesize);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t length, int prot,
+                          struct vnode *v, off_t offset, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr);
+size_t            as_vsize(struct addrspace *as);
 
 
 /*
@@ -0,0 +1,13 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Protection bits for mmap(). These must match the values in
+ * userland's <unistd.h>.
+ */
+
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+
+
+#endif /* _KERN_MMAN_H_ */
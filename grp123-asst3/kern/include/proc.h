@@ -65,6 +65,8 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 	struct filetable *p_filetable;	/* table of open files */
 
+	struct proc *p_allnext;		/* next on the list of all procs */
+
 	/* add more material here as needed */
 };
 
@@ -86,6 +88,12 @@ void proc_unfork(struct proc *proc);
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/*
+ * Call FN on every process, including the kernel's. The process list
+ * is locked with a spinlock meanwhile, so FN must not sleep.
+ */
+void proc_foreach(void (*fn)(struct proc *proc, void *data), void *data);
+
 /*
  * Cause the current process to exit. The current thread switches
  * itself into the kernel process.
@@ -56,8 +56,19 @@ struct sfs_vnode {
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* block a sequential read starts at */
+	uint32_t sv_raend;              /* blocks read ahead up to here */
+	unsigned sv_rawindow;           /* read-ahead blocks, 0 if random */
+	struct sfs_vnode *sv_hashnext;  /* next in its sfs_vnhash chain */
+	unsigned sv_index;              /* where it is in sfs_vnodes */
 };
 
+/*
+ * Loaded vnodes are hashed by inode number
+ */
+#define SFS_VNHASH_SIZE  256		/* must be a power of 2 */
+#define SFS_VNHASH(ino)  ((ino) & (SFS_VNHASH_SIZE - 1))
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -67,8 +78,10 @@ struct sfs_fs {
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* same, by inode */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct sfs_fs *sfs_wbnext;      /* next volume the syncer looks at */
 };
 
 /*
@@ -76,5 +89,17 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Buffer cache hit/miss counters (for the menu)
+ */
+void sfs_cache_printstats(void);
+void sfs_cache_resetstats(void);
+
+/*
+ * Largest sequential read-ahead window, in blocks (0 turns it off)
+ */
+unsigned sfs_readahead_max(void);
+void sfs_readahead_setmax(unsigned nblocks);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,41 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space management.
+ *
+ * Pages are paged out to a raw disk (SWAP_DEVICE) in page-sized
+ * slots. Slots are allocated from a bitmap and reference counted so
+ * that a swapped-out page can be shared by fork() the same way a
+ * resident frame is.
+ */
+
+#define SWAP_DEVICE "lhd1raw:"
+
+struct lock;
+
+/*
+ * Serializes page-out and page-in against each other and against
+ * as_copy/as_destroy, which walk page tables that page-out modifies.
+ */
+extern struct lock *swap_lock;
+
+/* Open the swap device; paging is disabled if there isn't one. */
+void swap_bootstrap(void);
+
+/* Number of slots on the swap device (0 if there is none). */
+unsigned swap_size(void);
+
+/* Allocate a free slot; ENOSPC if swap is full or absent. */
+int swap_alloc(unsigned *slot);
+
+/* Share a slot (fork) / drop a reference to a slot. */
+void swap_dup(unsigned slot);
+void swap_free(unsigned slot);
+
+/* Move a page between the frame at PADDR and swap slot SLOT. */
+int swap_out(unsigned slot, paddr_t paddr);
+int swap_in(unsigned slot, paddr_t paddr);
+
+
+#endif /* _SWAP_H_ */
@@ -37,10 +37,83 @@
  */
 #include <addrspace.h>
 
+struct addrspace;
+
 int pt_insert(vaddr_t vaddr, paddr_t paddr);
 paddr_t pt_lookup(vaddr_t vaddr);
 int pt_update(vaddr_t vaddr, paddr_t paddr);
 
+/*
+ * Page table operations on any address space. pt_entry_of returns
+ * NULL if VADDR's leaf has not been allocated. pt_copy makes NEW a
+ * copy-on-write copy of OLD's page table; pt_destroy frees every
+ * page and table of AS.
+ */
+paddr_t *pt_entry_of(struct addrspace *as, vaddr_t vaddr);
+int pt_copy(struct addrspace *old, struct addrspace *new);
+void pt_destroy(struct addrspace *as);
+
+/*
+ * Page table entries are TLBLO-format words (frame | TLBLO_DIRTY |
+ * TLBLO_VALID) with software bits in the low byte, which the TLB
+ * does not use:
+ *
+ *    PTE_WRITEABLE - the page may be written, possibly after a
+ *                    copy-on-write break. TLBLO_DIRTY is only set
+ *                    while the frame is private, or shared by
+ *                    PTE_SHARED mappings.
+ *    PTE_SWAPPED   - (without TLBLO_VALID) the page lives in swap
+ *                    slot PTE_SWAPSLOT(pte). PTE_WRITEABLE and
+ *                    TLBLO_DIRTY are kept.
+ *    PTE_SUPER     - the page was populated as part of a superpage
+ *                    (see vm.c); a refill loads its neighbours too.
+ *                    Dropped when the entry gets a different frame.
+ *    PTE_SHARED    - the page belongs to a shared file mapping: fork
+ *                    shares the frame itself rather than making it
+ *                    copy-on-write, and TLBLO_DIRTY says whether it
+ *                    has to be written back to the file.
+ *
+ * Permissions are worked out from the region when the entry is made
+ * (and fixed up by as_complete_load), so a TLB refill loads the
+ * entry as is without looking at the region list.
+ */
+#define PTE_SWAPPED        0x00000001
+#define PTE_WRITEABLE      0x00000002
+#define PTE_SUPER          0x00000004
+#define PTE_SHARED         0x00000008
+#define PTE_SWAPSLOT(pte)  ((pte) >> 12)
+#define PTE_MKSWAP(slot)   (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_TLBLO(pte)     ((pte) & (PAGE_FRAME | TLBLO_DIRTY | TLBLO_VALID))
+
+/*
+ * Per-address-space software TLB cache: a small direct-mapped table
+ * of recent translations consulted before the page table on a TLB
+ * miss. Anything that changes a PTE must invalidate its entry.
+ */
+void tlbcache_invalidate(struct addrspace *as, vaddr_t vaddr);
+void tlbcache_flush(struct addrspace *as);
+
+/*
+ * TLB management. Entries are tagged with the address space's ASID;
+ * vm_tlb_activate loads it (as_activate), vm_tlb_flush drops every
+ * entry of every address space. Call both at splhigh.
+ */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_flush(void);
+void vm_tlb_setasid(bool enabled);
+void vm_tlb_printstats(void);
+void vm_tlb_resetstats(void);
+
+/*
+ * Throw away the pages of AS in [START, END) (page aligned), freeing
+ * their frames and swap slots. For shrinking or removing regions.
+ */
+void vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+
+/* Write the modified pages of a shared file mapping back to the file */
+struct as_region;
+int vm_writeback(struct addrspace *as, struct as_region *region);
+
 #include <machine/vm.h>
 
 /* Fault-type arguments to vm_fault() */
@@ -52,12 +125,103 @@ int pt_update(vaddr_t vaddr, paddr_t paddr);
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Pages of memory plus swap: more than any process could ever use */
+unsigned vm_totalpages(void);
+
+/* Maximum size of a user stack, in bytes (stacklimit menu command) */
+size_t vm_stacklimit(void);
+void vm_setstacklimit(size_t bytes);
+
+/*
+ * Resident set limit for each process, in bytes (rsslimit menu
+ * command); 0 for none. A process at its limit pages out its own
+ * pages to take in more, and gets ENOMEM if it cannot.
+ */
+size_t vm_rsslimit(void);
+void vm_setrsslimit(size_t bytes);
+
+/*
+ * Fault-around window: on a run of TLB misses on ascending pages, up
+ * to this many following pages already in memory are loaded into
+ * the TLB too (faultaround menu command). 0 turns it off.
+ */
+unsigned vm_faultaround(void);
+void vm_setfaultaround(unsigned pages);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/*
+ * Allocate/free kernel heap pages (called by kmalloc/kfree). When
+ * memory is full alloc_kpages pages out user pages to make room
+ * (vm_reclaim), if the caller is in a state that allows it.
+ */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
+int vm_reclaim(void);
+
+/*
+ * 2^ORDER contiguous frames aligned to their size, each a separate
+ * one-frame allocation (freed, shared or paged out on its own). For
+ * superpages; 0 if there is no such block free.
+ */
+paddr_t frame_alloc_block(unsigned order);
+
+/*
+ * Page colors: frames and virtual pages whose page numbers agree in
+ * the low bits share a color. alloc_colored_kpage gives a frame for
+ * the user page at UVADDR of UVADDR's color when coloring is on and
+ * one is free. Returns 0 if out of memory.
+ */
+#define PAGE_COLORS 8
+#define PAGE_COLOR(addr) (((addr) >> 12) & (PAGE_COLORS - 1))
+vaddr_t alloc_colored_kpage(vaddr_t uvaddr);
+void frame_setcoloring(bool enabled);
+bool frame_coloring(void);
+
+/*
+ * A page of zeros for the user page at UVADDR (colored the same
+ * way), preferably from the pool that the zerod thread (started by
+ * frame_zero_bootstrap) fills in the background. Returns 0 if out of
+ * memory.
+ */
+vaddr_t alloc_zeroed_kpage(vaddr_t uvaddr);
+void frame_zero_bootstrap(void);
+
+/*
+ * User frame mappings (reverse map). frame_map records that AS maps
+ * the frame at VADDR and takes a reference (ENOMEM if out of memory
+ * to record it); frame_unmap drops it, freeing the frame with the
+ * last. Frames shared copy-on-write have one mapping per sharer.
+ */
+int frame_map(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void frame_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+/* frame_unmap of up to FRAME_BATCH_MAX pages of AS in one go */
+#define FRAME_BATCH_MAX 32
+void frame_unmap_batch(struct addrspace *as, const paddr_t *paddrs,
+                       const vaddr_t *vaddrs, unsigned n);
+unsigned frame_refcount(paddr_t paddr);
+void frame_pin(paddr_t paddr);
+
+/*
+ * Page-out support: reference bits, victim selection, mappings.
+ * Everything that drops a reference to a user frame must hold
+ * swap_lock, so that a frame cannot go away between frame_victim and
+ * frame_unmap_all. frame_foreach_mapping returns the number of
+ * mappings visited, 0 if the frame is no longer a mapped user frame.
+ */
+void frame_touch(paddr_t paddr);
+bool frame_clear_referenced(paddr_t paddr);
+int frame_victim(paddr_t *paddr);
+unsigned frame_foreach_mapping(paddr_t paddr,
+                           void (*fn)(struct addrspace *as, vaddr_t vaddr,
+                                      void *data),
+                           void *data);
+void frame_unmap_all(paddr_t paddr);
+
+/* Print free frame counts per buddy order (frames menu command). */
+void frame_printstats(void);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -0,0 +1,39 @@
+#ifndef _VMSTAT_H_
+#define _VMSTAT_H_
+
+/*
+ * VM event counters (vmstat menu command).
+ *
+ * Each cpu counts into its own row, so counting takes no lock and
+ * the cpus do not fight over a cache line; vmstat_print adds the
+ * rows up. A counter is bumped with vmstat_inc or vmstat_add.
+ */
+
+enum vmstat_counter {
+        VMSTAT_TLB_MISS,        /* TLB misses taken by vm_fault */
+        VMSTAT_READONLY_FAULT,  /* writes to read-only (COW) pages */
+        VMSTAT_ZERO_FILL,       /* first touches needing no file read */
+        VMSTAT_LEAF_ALLOC,      /* page-table leaves allocated */
+        VMSTAT_FRAME_ALLOC,     /* frames allocated */
+        VMSTAT_FRAME_FREE,      /* frames freed */
+        VMSTAT_FORK_PAGES,      /* pages made copy-on-write by fork */
+        VMSTAT_COW_COPY,        /* pages copied on a COW break */
+        VMSTAT_TLB_LOAD,        /* entries loaded with tlb_random */
+        VMSTAT_TLB_EVICT,       /* ... that (likely) pushed one out */
+        VMSTAT_ZERO_HIT,        /* zeroed pages from the zerod pool */
+        VMSTAT_ZERO_MISS,       /* ... and zeroed on the spot instead */
+        VMSTAT_ZERO_BG,         /* frames zeroed by zerod */
+        VMSTAT_COLOR_HIT,       /* user frames of the page's color */
+        VMSTAT_COLOR_MISS,      /* ... and of another, none being free */
+        VMSTAT_RSS_RECLAIM,     /* pages paged out for an RSS limit */
+        VMSTAT_NCOUNTERS
+};
+
+void vmstat_add(enum vmstat_counter counter, unsigned n);
+void vmstat_print(void);
+void vmstat_reset(void);
+
+#define vmstat_inc(counter) vmstat_add(counter, 1)
+
+
+#endif /* _VMSTAT_H_ */
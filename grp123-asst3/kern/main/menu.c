@@ -45,8 +45,13 @@
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <vmstat.h>
+#include <addrspace.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
+#include "opt-unsw.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -500,6 +505,332 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Parse a number argument of a tuning command. Only plain decimal
+ * digits are taken; atoi would quietly turn junk into 0 and a minus
+ * sign into a huge unsigned value. Returns 0 on success.
+ */
+static
+int
+getuint(const char *str, unsigned *ret)
+{
+	unsigned val = 0;
+
+	if (*str == '\0') {
+		return EINVAL;
+	}
+	for (; *str != '\0'; str++) {
+		if (*str < '0' || *str > '9') {
+			return EINVAL;
+		}
+		if (val > ((unsigned)-1 - (*str - '0')) / 10) {
+			return EINVAL;
+		}
+		val = val * 10 + (*str - '0');
+	}
+	*ret = val;
+	return 0;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Command for the TLB counters. "tlbstat asid off" goes back to
+ * flushing the TLB on every context switch, for comparison.
+ */
+static
+int
+cmd_tlbstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_tlb_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_tlb_resetstats();
+	}
+	else if (nargs == 3 && !strcmp(args[1], "asid") &&
+		 (!strcmp(args[2], "on") || !strcmp(args[2], "off"))) {
+		vm_tlb_setasid(!strcmp(args[2], "on"));
+	}
+	else {
+		kprintf("Usage: tlbstat [reset | asid on|off]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a size in kbytes for the limit commands (see getuint).
+ * Returns 0 on success.
+ */
+static
+int
+getkbytes(const char *str, size_t *ret)
+{
+	unsigned kbytes;
+
+	if (getuint(str, &kbytes) || kbytes > (size_t)-1 / 1024) {
+		return EINVAL;
+	}
+	*ret = (size_t)kbytes * 1024;
+	return 0;
+}
+
+/*
+ * Command for the user stack limit.
+ */
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	size_t limit;
+
+	if (nargs == 2 && getkbytes(args[1], &limit) == 0) {
+		vm_setstacklimit(limit);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: stacklimit [kbytes]\n");
+		return EINVAL;
+	}
+
+	kprintf("User stack limit: %uk\n", (unsigned)(vm_stacklimit() / 1024));
+	return 0;
+}
+
+/*
+ * Command for the VM event counters.
+ */
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vmstat_reset();
+	}
+	else {
+		kprintf("Usage: vmstat [reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for the per-process resident set limit.
+ */
+static
+int
+cmd_rsslimit(int nargs, char **args)
+{
+	size_t limit;
+
+	if (nargs == 2 && getkbytes(args[1], &limit) == 0) {
+		vm_setrsslimit(limit);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: rsslimit [kbytes]\n");
+		return EINVAL;
+	}
+
+	if (vm_rsslimit() == 0) {
+		kprintf("Resident set limit: none\n");
+	}
+	else {
+		kprintf("Resident set limit: %uk\n",
+			(unsigned)(vm_rsslimit() / 1024));
+	}
+	return 0;
+}
+
+/*
+ * What ps prints about one process. proc_foreach holds allprocs_lock
+ * while it runs the callback, so the callback only copies these out
+ * and the printing is done after the lock is released.
+ */
+struct ps_entry {
+	pid_t pid;
+	unsigned rss;
+	size_t vsz;
+	char name[16];
+};
+
+struct ps_snapshot {
+	struct ps_entry *entries;
+	unsigned count;
+	unsigned max;
+};
+
+/*
+ * Record one process. The address space is looked at under p_lock
+ * so it cannot be swapped out from under us by exec or exit; only
+ * its counters are read, since the process may be changing its
+ * regions meanwhile.
+ */
+static
+void
+ps_proc(struct proc *proc, void *data)
+{
+	struct ps_snapshot *snap = data;
+	struct ps_entry *e;
+	struct addrspace *as;
+
+	if (snap->count == snap->max) {
+		return;
+	}
+	e = &snap->entries[snap->count++];
+
+	e->pid = proc->p_pid;
+	e->rss = 0;
+	e->vsz = 0;
+	snprintf(e->name, sizeof(e->name), "%s", proc->p_name);
+	spinlock_acquire(&proc->p_lock);
+	as = proc->p_addrspace;
+	if (as != NULL) {
+		e->rss = as->rss;
+		e->vsz = as_vsize(as);
+	}
+	spinlock_release(&proc->p_lock);
+}
+
+/*
+ * Command to list processes with their memory use.
+ */
+static
+int
+cmd_ps(int nargs, char **args)
+{
+	struct ps_snapshot snap;
+	struct ps_entry *e;
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	/* at most PROCS_MAX pids are in use, plus the kernel */
+	snap.max = PROCS_MAX + 1;
+	snap.count = 0;
+	snap.entries = kmalloc(snap.max * sizeof(struct ps_entry));
+	if (snap.entries == NULL) {
+		return ENOMEM;
+	}
+	proc_foreach(ps_proc, &snap);
+
+	kprintf("%5s %8s %8s  %s\n", "PID", "RSS(k)", "VSZ(k)", "NAME");
+	for (i = 0; i < snap.count; i++) {
+		e = &snap.entries[i];
+		kprintf("%5d %8u %8u  %s\n", (int)e->pid,
+			e->rss * (PAGE_SIZE / 1024), (unsigned)(e->vsz / 1024),
+			e->name);
+	}
+	kfree(snap.entries);
+	return 0;
+}
+
+/*
+ * Command for the fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	unsigned pages;
+
+	if (nargs == 2 && getuint(args[1], &pages) == 0) {
+		vm_setfaultaround(pages);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: faultaround [pages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Fault-around window: %u pages\n", vm_faultaround());
+	return 0;
+}
+#endif
+
+#if OPT_UNSW
+/*
+ * Command for the free frame counts of the buddy allocator.
+ */
+static
+int
+cmd_frames(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	frame_printstats();
+	return 0;
+}
+
+/*
+ * Command for page coloring of user frames.
+ */
+static
+int
+cmd_coloring(int nargs, char **args)
+{
+	if (nargs == 2 && (!strcmp(args[1], "on") || !strcmp(args[1], "off"))) {
+		frame_setcoloring(!strcmp(args[1], "on"));
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: coloring [on|off]\n");
+		return EINVAL;
+	}
+
+	kprintf("Page coloring: %s\n", frame_coloring() ? "on" : "off");
+	return 0;
+}
+#endif
+
+#if OPT_SFS
+/*
+ * Command for the SFS buffer cache counters.
+ */
+static
+int
+cmd_bufstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		sfs_cache_printstats();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sfs_cache_resetstats();
+	}
+	else {
+		kprintf("Usage: bufstat [reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Command for the SFS read-ahead window.
+ */
+static
+int
+cmd_readahead(int nargs, char **args)
+{
+	unsigned blocks;
+
+	if (nargs == 2 && getuint(args[1], &blocks) == 0) {
+		sfs_readahead_setmax(blocks);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: readahead [blocks]\n");
+		return EINVAL;
+	}
+
+	kprintf("SFS read-ahead window: up to %u blocks\n",
+		sfs_readahead_max());
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -606,6 +937,22 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[tlbstat] TLB miss/switch counters  ",
+	"[stacklimit] User stack limit       ",
+	"[faultaround] TLB fault-around pages",
+	"[rsslimit] Per-process RSS limit    ",
+	"[ps] Processes and memory use       ",
+	"[vmstat] VM event counters          ",
+#endif
+#if OPT_UNSW
+	"[frames] Free frames by buddy order ",
+	"[coloring] Page coloring on/off     ",
+#endif
+#if OPT_SFS
+	"[bufstat] SFS buffer cache counters ",
+	"[readahead] SFS read-ahead window   ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +1004,22 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "tlbstat",    cmd_tlbstat },
+	{ "stacklimit", cmd_stacklimit },
+	{ "faultaround", cmd_faultaround },
+	{ "rsslimit",   cmd_rsslimit },
+	{ "ps",         cmd_ps },
+	{ "vmstat",     cmd_vmstat },
+#endif
+#if OPT_UNSW
+	{ "frames",     cmd_frames },
+	{ "coloring",   cmd_coloring },
+#endif
+#if OPT_SFS
+	{ "bufstat",    cmd_bufstat },
+	{ "readahead",  cmd_readahead },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -58,6 +58,13 @@
  */
 struct proc *kproc;
 
+/*
+ * Every process, for proc_foreach. Processes go on the list when
+ * created and come off first thing when destroyed.
+ */
+static struct spinlock allprocs_lock = SPINLOCK_INITIALIZER;
+static struct proc *allprocs;
+
 /*
  * Create a proc structure.
  */
@@ -95,6 +102,11 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
 
+	spinlock_acquire(&allprocs_lock);
+	proc->p_allnext = allprocs;
+	allprocs = proc;
+	spinlock_release(&allprocs_lock);
+
 	return proc;
 }
 
@@ -107,6 +119,8 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+	struct proc **pp;
+
 	/*
 	 * You probably want to destroy and null out much of the
 	 * process (particularly the address space) at exit time if
@@ -124,6 +138,13 @@ proc_destroy(struct proc *proc)
 	 * incorrect to destroy it.)
 	 */
 
+	spinlock_acquire(&allprocs_lock);
+	for (pp = &allprocs; *pp != proc; pp = &(*pp)->p_allnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_allnext;
+	spinlock_release(&allprocs_lock);
+
 	/* VFS fields */
 	if (proc->p_cwd) {
 		VOP_DECREF(proc->p_cwd);
@@ -191,6 +212,18 @@ proc_destroy(struct proc *proc)
 	kfree(proc);
 }
 
+void
+proc_foreach(void (*fn)(struct proc *proc, void *data), void *data)
+{
+	struct proc *proc;
+
+	spinlock_acquire(&allprocs_lock);
+	for (proc = allprocs; proc != NULL; proc = proc->p_allnext) {
+		fn(proc, data);
+	}
+	spinlock_release(&allprocs_lock);
+}
+
 /*
  * Create the process structure for the kernel.
  */
@@ -0,0 +1,120 @@
+/*
+ * VM-related syscalls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <syscall.h>
+
+
+/*
+ * sys_sbrk
+ *
+ * Move the end of the heap; returns the old end. The heap region is
+ * set up by as_complete_load() and its pages are allocated on fault.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)oldbreak;
+	return 0;
+}
+
+/*
+ * sys_mmap
+ *
+ * Map LENGTH bytes of file FD from OFFSET, or anonymous zeroed memory
+ * if FD is -1. Pages are faulted in from the file. A mapping with
+ * PROT_WRITE is shared with the file, so the file must be open for
+ * writing as well as reading.
+ */
+int
+sys_mmap(size_t length, int prot, int fd, off_t offset, int32_t *retval)
+{
+	struct addrspace *as;
+	struct openfile *file;
+	vaddr_t vaddr;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	if (fd == -1) {
+		result = as_mmap(as, length, prot, NULL, 0, &vaddr);
+		if (result) {
+			return result;
+		}
+		*retval = (int32_t)vaddr;
+		return 0;
+	}
+
+	result = filetable_get(curproc->p_filetable, fd, &file);
+	if (result) {
+		return result;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		result = EACCES;
+		goto out;
+	}
+
+	/* does the filesystem allow it? */
+	result = VOP_MMAP(file->of_vnode);
+	if (result) {
+		goto out;
+	}
+
+	result = as_mmap(as, length, prot, file->of_vnode, offset, &vaddr);
+	if (result) {
+		goto out;
+	}
+	*retval = (int32_t)vaddr;
+
+out:
+	filetable_put(curproc->p_filetable, fd, file);
+	return result;
+}
+
+/*
+ * sys_munmap
+ *
+ * Remove a mapping made by mmap, writing back a shared one.
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	return as_munmap(as, (vaddr_t)addr);
+}
@@ -29,6 +29,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -37,6 +39,9 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <synch.h>
+#include <swap.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -63,13 +68,21 @@ as_create(void)
 	 */
 	
 	as->head = NULL;
-	paddr_t **table = kmalloc(2048 * sizeof(paddr_t *));
-	as->pagetable = table;
-	
-	for (int i = 0; i < 2048; i++) {
+	as->heap = NULL;
+	as->stack = NULL;
+	/* the rest of the page table is allocated as it is used */
+	for (int i = 0; i < PT_TOP_SIZE; i++) {
 		as->pagetable[i] = NULL;
 	}
-
+	as->pt_bytes = 0;
+	tlbcache_flush(as);
+	as->asid = 0;
+	as->asid_generation = 0;
+	as->fault_last = 0;
+	as->fault_run = 0;
+	as->rss = 0;
+	as->rss_hand = 0;
+	as->vsize = 0;
 
 	return as;
 }
@@ -79,6 +92,7 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new_as;
+	int spl, result;
 
 	new_as = as_create();
 	if (new_as == NULL) {
@@ -91,6 +105,10 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	for (struct as_region *old_r = old->head; old_r != NULL; old_r = old_r->next) {
 
 		struct as_region *temp = kmalloc(sizeof(struct as_region));
+		if (temp == NULL) {
+			as_destroy(new_as);
+			return ENOMEM;
+		}
 		temp->next = NULL;
 		temp->size = old_r->size;
 		temp->readable = old_r->readable;
@@ -98,6 +116,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		temp->executable = old_r->executable;
 		temp->loading = old_r->loading;
 		temp->vbase = old_r->vbase;
+		temp->vn = old_r->vn;
+		temp->file_offset = old_r->file_offset;
+		temp->filesize = old_r->filesize;
+		temp->mapped = old_r->mapped;
+		temp->shared = old_r->shared;
+		if (temp->vn != NULL) {
+			VOP_INCREF(temp->vn);
+		}
+		if (old_r == old->heap) {
+			new_as->heap = temp;
+		}
+		if (old_r == old->stack) {
+			new_as->stack = temp;
+		}
 		
 		if (new_as->head == NULL) {
 			new_as->head = temp;
@@ -107,32 +139,19 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 			curr = temp;
 		}
 	}
+	new_as->vsize = old->vsize;
 
-	//pagetable copy
-	for (int i = 0; i < 2048; i++) {
-		if(old->pagetable[i] != NULL) {
-			new_as->pagetable[i] = kmalloc(512 * sizeof(paddr_t));
-
-			if (new_as->pagetable[i] == NULL) {
-				return ENOMEM;
-			}
-
-			for (int j = 0; j < 512; j++) {
-				if(old->pagetable[i][j]!=0) {
-					vaddr_t newvad = alloc_kpages(1);
-					bzero((void *) newvad, PAGE_SIZE);
-					memmove((void *) newvad, (void *) PADDR_TO_KVADDR(old->pagetable[i][j] & PAGE_FRAME), PAGE_SIZE);
-					paddr_t temp = KVADDR_TO_PADDR(newvad) & PAGE_FRAME;
-					temp = temp|((TLBLO_DIRTY|TLBLO_VALID) & old->pagetable[i][j]); 
-					new_as->pagetable[i][j] = temp;
+	/* copy-on-write, except shared mappings; see pt_copy */
+	result = pt_copy(old, new_as);
+	if (result) {
+		as_destroy(new_as);
+		return result;
+	}
 
-				}
-				else {
-					new_as->pagetable[i][j] = 0;
-				}
-			}
-		}
-	} 
+	/* the parent may still have writable TLB entries for shared frames */
+	spl = splhigh();
+	vm_tlb_flush();
+	splx(spl);
 		
 	*ret = new_as;
 	return 0;
@@ -143,35 +162,35 @@ void
 as_destroy(struct addrspace *as)
 {	
 	
-	for (int i = 0; i < 2048; i++) {
-		if (as->pagetable[i] != NULL) {
-			for(int j = 0; j < 512; j++) {
-				if(as->pagetable[i][j] != 0) {
-					free_kpages(PADDR_TO_KVADDR(as->pagetable[i][j] & PAGE_FRAME));
-				}
-			}
-			kfree(as->pagetable[i]);
+	for (struct as_region *r = as->head; r != NULL; r = r->next) {
+		if (r->shared) {
+			/* nobody to report an error to */
+			(void)vm_writeback(as, r);
 		}
 	}
 
+	pt_destroy(as);
+
 	struct as_region* temp; 
 	struct as_region* temp2 = as->head;
 
 	while (temp2 != NULL) {
 		temp = temp2; 
 		temp2 = temp2->next;
+		if (temp->vn != NULL) {
+			VOP_DECREF(temp->vn);
+		}
 		kfree(temp);
 	}
 
 
-	kfree(as->pagetable);
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
+	int spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -183,12 +202,12 @@ as_activate(void)
 		return;
 	}
 
+	/*
+	 * TLB entries are tagged with ASIDs, so the old address
+	 * space's entries can stay; just switch the current ASID.
+	 */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
+	vm_tlb_activate(as);
 	splx(spl);
 }
 
@@ -196,30 +215,19 @@ void
 as_deactivate(void)
 {
 	/*
-	 * Write this. For many designs it won't need to actually do
-	 * anything. See proc.c for an explanation of why it (might)
-	 * be needed.
+	 * Nothing to do: an address space being destroyed keeps its
+	 * ASID until the generation rolls over, and the rollover
+	 * flushes whatever entries it left behind.
 	 */
+}
 
-	int i, spl;
-	struct addrspace *as;
-
-	as = proc_getas();
-	if (as == NULL) {
-		/*
-		 * Kernel thread without an address space; leave the
-		 * prior address space in place.
-		 */
-		return;
-	}
-
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+/* bytes of address space REGION covers, in whole pages */
+static
+size_t
+as_region_span(struct as_region *region)
+{
+	return ROUNDUP(region->vbase + region->size, PAGE_SIZE) -
+		(region->vbase & PAGE_FRAME);
 }
 
 /*
@@ -238,7 +246,9 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 {
 	
 	struct as_region *new_region = kmalloc(sizeof(struct as_region));
-
+	if (new_region == NULL) {
+		return ENOMEM;
+	}
 
 	new_region->next = NULL;
 	new_region->size = memsize;
@@ -247,6 +257,12 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	new_region->executable = executable;
 	new_region->loading = 0;
 	new_region->vbase = vaddr;
+	new_region->vn = NULL;
+	new_region->file_offset = 0;
+	new_region->filesize = 0;
+	new_region->mapped = 0;
+	new_region->shared = 0;
+	as->vsize += as_region_span(new_region);
 
 	if (as->head == NULL) {
 		as->head = new_region;
@@ -276,22 +292,312 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
+	vaddr_t top;
+	int spl;
+	int result;
 	
+	/*
+	 * Pages of read-only regions were made writeable so they could
+	 * be loaded; take that back now. Swapped-out pages keep their
+	 * PTE_WRITEABLE bit in the PTE too.
+	 */
+	lock_acquire(swap_lock);
 	for (struct as_region *curr = as->head; curr != NULL; curr = curr->next) {
 		curr->loading = 0;
+		if (curr->writeable != 0) {
+			continue;
+		}
+		for (vaddr_t va = curr->vbase & PAGE_FRAME;
+		     va < curr->vbase + curr->size; va += PAGE_SIZE) {
+			paddr_t *pte = pt_entry_of(as, va);
+			if (pte != NULL) {
+				*pte &= ~(PTE_WRITEABLE | TLBLO_DIRTY);
+			}
+		}
 	}
+	tlbcache_flush(as);
+	lock_release(swap_lock);
+
+	/* drop writable TLB entries made while loading */
+	spl = splhigh();
+	vm_tlb_flush();
+	splx(spl);
 	as_activate();
 
+	/* The heap starts empty on the page after the last segment. */
+	top = 0;
+	for (struct as_region *curr = as->head; curr != NULL; curr = curr->next) {
+		if (curr->vbase + curr->size > top) {
+			top = curr->vbase + curr->size;
+		}
+	}
+	top = ROUNDUP(top, PAGE_SIZE);
+	result = as_define_region(as, top, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	/* as_define_region appends, so it is the last one */
+	as->heap = as->head;
+	while (as->heap->next != NULL) {
+		as->heap = as->heap->next;
+	}
+
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	int result;
+
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 	
+	/* one page to start with; vm_fault grows it */
+	result = as_define_region(as, USERSTACK - PAGE_SIZE, PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	as->stack = as->head;
+	while (as->stack->next != NULL) {
+		as->stack = as->stack->next;
+	}
 
-	return as_define_region(as, *stackptr - (16 * PAGE_SIZE), 16 * PAGE_SIZE, 1, 1, 0);
+	return 0;
 }
 
+int
+as_map_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+	    off_t offset, size_t filesize)
+{
+	struct as_region *curr;
+
+	for (curr = as->head; curr != NULL; curr = curr->next) {
+		if (curr->vbase == vaddr) {
+			break;
+		}
+	}
+	if (curr == NULL) {
+		return EINVAL;
+	}
+	KASSERT(filesize <= curr->size);
+
+	if (curr->vn != NULL) {
+		VOP_DECREF(curr->vn);
+	}
+	VOP_INCREF(v);
+	curr->vn = v;
+	curr->file_offset = offset;
+	curr->filesize = filesize;
+
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct as_region *heap = as->heap;
+	vaddr_t oldend, newend;
+	size_t limit, shrink;
+
+	if (heap == NULL) {
+		/* not loaded from an executable */
+		return ENOMEM;
+	}
+
+	oldend = heap->vbase + heap->size;
+
+	if (amount < 0) {
+		/* negate unsigned: -amount overflows for INTPTR_MIN */
+		shrink = -(size_t)amount;
+		if (shrink > heap->size) {
+			return EINVAL;
+		}
+		newend = oldend - shrink;
+	}
+	else {
+		/*
+		 * Stop short of the stack, and don't promise more than
+		 * memory plus swap could ever hold.
+		 */
+		limit = (size_t)vm_totalpages() * PAGE_SIZE;
+		if ((size_t)amount > USERSTACK - oldend ||
+		    heap->size + amount > limit) {
+			return ENOMEM;
+		}
+		newend = oldend + amount;
+
+		/* keep a guard gap below whatever is above the heap */
+		for (struct as_region *r = as->head; r != NULL; r = r->next) {
+			if (r != heap && r->vbase >= oldend &&
+			    newend + STACK_GUARD > (r->vbase & PAGE_FRAME)) {
+				return ENOMEM;
+			}
+		}
+	}
+
+	/* pages wholly above the new end go; growth is lazy */
+	if (ROUNDUP(newend, PAGE_SIZE) < ROUNDUP(oldend, PAGE_SIZE)) {
+		vm_unmap_range(as, ROUNDUP(newend, PAGE_SIZE),
+			       ROUNDUP(oldend, PAGE_SIZE));
+	}
+
+	as->vsize -= as_region_span(heap);
+	heap->size = newend - heap->vbase;
+	as->vsize += as_region_span(heap);
+	*oldbreak = oldend;
+	return 0;
+}
+
+/*
+ * Find SIZE bytes (page aligned) of unused address space for mmap,
+ * working down from the lowest the stack could grow to. The heap and
+ * stack keep their guard gaps.
+ */
+static
+int
+as_find_gap(struct addrspace *as, size_t size, vaddr_t *ret)
+{
+	struct as_region *r;
+	vaddr_t start, end, cand;
+	bool moved;
+
+	if (size + vm_stacklimit() + STACK_GUARD > USERSTACK) {
+		return ENOMEM;
+	}
+	cand = USERSTACK - vm_stacklimit() - STACK_GUARD - size;
+
+	do {
+		moved = false;
+		for (r = as->head; r != NULL; r = r->next) {
+			start = r->vbase & PAGE_FRAME;
+			end = ROUNDUP(r->vbase + r->size, PAGE_SIZE);
+			if (r == as->heap || r == as->stack) {
+				start = start > STACK_GUARD ? start - STACK_GUARD : 0;
+				end += STACK_GUARD;
+			}
+			if (cand < end && cand + size > start) {
+				if (start < size + PAGE_SIZE) {
+					return ENOMEM;
+				}
+				cand = start - size;
+				moved = true;
+			}
+		}
+	} while (moved);
+
+	*ret = cand;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t length, int prot, struct vnode *v,
+	off_t offset, vaddr_t *ret)
+{
+	struct as_region *region;
+	struct stat st;
+	vaddr_t vaddr;
+	size_t size;
+	int result;
+
+	if (length == 0 || (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+	if (v != NULL && (offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0)) {
+		return EINVAL;
+	}
+	if (length > USERSTACK) {
+		return ENOMEM;
+	}
+	size = ROUNDUP(length, PAGE_SIZE);
+
+	result = as_find_gap(as, size, &vaddr);
+	if (result) {
+		return result;
+	}
+
+	result = as_define_region(as, vaddr, size, prot & PROT_READ,
+				  prot & PROT_WRITE, 0);
+	if (result) {
+		return result;
+	}
+	/* as_define_region appends */
+	region = as->head;
+	while (region->next != NULL) {
+		region = region->next;
+	}
+	region->mapped = 1;
+
+	if (v != NULL) {
+		result = VOP_STAT(v, &st);
+		if (result) {
+			as_munmap(as, vaddr);
+			return result;
+		}
+
+		/* pages past the end of the file read as zeros */
+		region->filesize = 0;
+		if (st.st_size > offset) {
+			region->filesize = st.st_size - offset < (off_t)size ?
+				st.st_size - offset : size;
+		}
+		VOP_INCREF(v);
+		region->vn = v;
+		region->file_offset = offset;
+		region->shared = (prot & PROT_WRITE) != 0;
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *region, *prev;
+	int result;
+
+	prev = NULL;
+	for (region = as->head; region != NULL; region = region->next) {
+		if (region->mapped && region->vbase == vaddr) {
+			break;
+		}
+		prev = region;
+	}
+	if (region == NULL) {
+		return EINVAL;
+	}
+
+	if (region->shared) {
+		result = vm_writeback(as, region);
+		if (result) {
+			return result;
+		}
+	}
+	vm_unmap_range(as, region->vbase, region->vbase + region->size);
+
+	if (prev == NULL) {
+		as->head = region->next;
+	}
+	else {
+		prev->next = region->next;
+	}
+	as->vsize -= as_region_span(region);
+	if (region->vn != NULL) {
+		VOP_DECREF(region->vn);
+	}
+	kfree(region);
+
+	return 0;
+}
+
+/*
+ * Other processes (ps) call this, so it must not walk the region
+ * list, which the owner changes without a lock.
+ */
+size_t
+as_vsize(struct addrspace *as)
+{
+	return as->vsize;
+}
@@ -0,0 +1,153 @@
+/*
+ * Swap space management.
+ *
+ * The swap "file" is a whole raw disk. Slot N lives at byte offset
+ * N * PAGE_SIZE. All of this runs under swap_lock, which callers
+ * take; the bitmap and reference counts need no other protection.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+struct lock *swap_lock;
+
+static struct vnode *swap_vnode;	/* NULL if there is no swap */
+static struct bitmap *swap_map;		/* allocated slots */
+static uint16_t *swap_refcount;		/* sharers of each slot */
+static unsigned swap_nslots;
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	swap_lock = lock_create("swap");
+	if (swap_lock == NULL) {
+		panic("swap: lock_create failed\n");
+	}
+
+	/* vfs_open destroys the path it is given */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: cannot open %s (%s), paging disabled\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: cannot stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_refcount = kmalloc(swap_nslots * sizeof(uint16_t));
+	if (swap_map == NULL || swap_refcount == NULL) {
+		panic("swap: out of memory for %u slots\n", swap_nslots);
+	}
+	bzero(swap_refcount, swap_nslots * sizeof(uint16_t));
+
+	kprintf("swap: %uk on %s\n", swap_nslots * (PAGE_SIZE / 1024),
+		SWAP_DEVICE);
+}
+
+unsigned
+swap_size(void)
+{
+	/* fixed after swap_bootstrap, no lock needed */
+	return swap_vnode == NULL ? 0 : swap_nslots;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+	if (bitmap_alloc(swap_map, slot)) {
+		return ENOSPC;
+	}
+	swap_refcount[*slot] = 1;
+	return 0;
+}
+
+void
+swap_dup(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(swap_refcount[slot] > 0);
+
+	swap_refcount[slot]++;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(swap_refcount[slot] > 0);
+
+	swap_refcount[slot]--;
+	if (swap_refcount[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+	}
+}
+
+/*
+ * Common code for swap_in and swap_out.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_out(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
@@ -2,28 +2,117 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
+#include <cpu.h>
+#include <current.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <machine/tlb.h>
 #include <spl.h>
+#include <spinlock.h>
 #include <proc.h>
+#include <synch.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vmstat.h>
 
 /* Place your page table functions here */
 
+/*
+ * The zero page: one frame of zeros, mapped read-only wherever an
+ * anonymous page is read before it is written. Writing it is an
+ * ordinary copy-on-write break. The kernel keeps a reference so it
+ * is never freed or paged out.
+ */
+static paddr_t vm_zeropage;
+
+static vaddr_t vm_getpage(vaddr_t vaddr);
+
+/*
+ * Whether an entry counts toward its address space's resident set
+ * (as->rss): a page in memory, other than the shared zero page.
+ * Page-out changes the rss of whichever address space owns the
+ * victim, so every change to it is made at splhigh (or under
+ * swap_lock, which page-out holds).
+ */
+#define PTE_RESIDENT(pte) \
+    (((pte) & TLBLO_VALID) && ((pte) & PAGE_FRAME) != vm_zeropage)
+
+/*
+ * Pointer to the page table entry for VADDR in AS, or NULL if its
+ * leaf table has not been allocated. Unlike pt_insert/lookup/update
+ * this works on any address space, which page-out needs.
+ */
+paddr_t *pt_entry_of(struct addrspace *as, vaddr_t vaddr)
+{
+    struct pt_dir *dir = as->pagetable[PT_TOP(vaddr)];
+
+    if (dir == NULL || dir->leaf[PT_DIR(vaddr)] == NULL) {
+        return NULL;
+    }
+
+    return &dir->leaf[PT_DIR(vaddr)][PT_LEAF(vaddr)];
+}
+
+
+/*
+ * Like pt_entry_of, but allocates the directory and leaf if needed.
+ * Returns NULL if out of memory.
+ */
+static paddr_t *pt_entry_alloc(struct addrspace *as, vaddr_t vaddr)
+{
+    struct pt_dir **dir = &as->pagetable[PT_TOP(vaddr)];
+    paddr_t **leaf;
+
+    if (*dir == NULL) {
+        *dir = kmalloc(sizeof(struct pt_dir));
+        if (*dir == NULL) {
+            return NULL;
+        }
+        bzero(*dir, sizeof(struct pt_dir));
+        as->pt_bytes += sizeof(struct pt_dir);
+    }
+
+    leaf = &(*dir)->leaf[PT_DIR(vaddr)];
+    if (*leaf == NULL) {
+        *leaf = kmalloc(PT_LEAF_SIZE * sizeof(paddr_t));
+        if (*leaf == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < PT_LEAF_SIZE; i++) {
+            (*leaf)[i] = 0;
+        }
+        as->pt_bytes += PT_LEAF_SIZE * sizeof(paddr_t);
+        vmstat_inc(VMSTAT_LEAF_ALLOC);
+    }
+
+    return &(*leaf)[PT_LEAF(vaddr)];
+}
+
+
 int pt_insert(vaddr_t vaddr, paddr_t paddr) 
 {
-    uint32_t upper = vaddr >> 21;
-    uint32_t lower = vaddr << 11 >> 23;
     struct addrspace *as = proc_getas();
+    paddr_t *pte;
+    int spl;
 
-    if (as->pagetable[upper] == NULL) {
-        as->pagetable[upper] = kmalloc(512 * sizeof(paddr_t));
-        for (int i = 0; i < 512; i++) {
-            as->pagetable[upper][i] = 0;
-        }
-    } 
+    KASSERT(paddr != 0);
 
-    as->pagetable[upper][lower] = paddr;
+    pte = pt_entry_alloc(as, vaddr);
+    if (pte == NULL) {
+        return ENOMEM;
+    }
+
+    /* page-out may be changing as->rss too; see PTE_RESIDENT */
+    spl = splhigh();
+    if (*pte == 0) {
+        as->pagetable[PT_TOP(vaddr)]->npages[PT_DIR(vaddr)]++;
+    }
+    as->rss += PTE_RESIDENT(paddr);
+    as->rss -= PTE_RESIDENT(*pte);
+    *pte = paddr;
+    tlbcache_invalidate(as, vaddr);
+    splx(spl);
     
     return 0;
 }
@@ -31,39 +120,262 @@ int pt_insert(vaddr_t vaddr, paddr_t paddr)
 
 paddr_t pt_lookup(vaddr_t vaddr) 
 {
-    uint32_t upper = vaddr >> 21;
-    uint32_t lower = vaddr << 11 >> 23;
-    struct addrspace *as = proc_getas();
+    paddr_t *pte = pt_entry_of(proc_getas(), vaddr);
 
-    
-    if (as->pagetable[upper] == NULL) {
-        // kprintf("fail\n");
+    if (pte == NULL) {
         return 0;
     }
     
-    return as->pagetable[upper][lower];
+    return *pte;
 }
 
 
 int pt_update(vaddr_t vaddr, paddr_t paddr)
 {
-    uint32_t upper = vaddr >> 21;
-    uint32_t lower = vaddr << 11 >> 23;
-    struct addrspace *as = proc_getas();
+    return pt_insert(vaddr, paddr);
+}
+
+
+/*
+ * Clear the entry for VADDR in AS, which must be in use, and free
+ * its leaf once nothing in it is left. Returns the old entry.
+ */
+static paddr_t pt_clear(struct addrspace *as, vaddr_t vaddr)
+{
+    struct pt_dir *dir = as->pagetable[PT_TOP(vaddr)];
+    paddr_t **leaf = &dir->leaf[PT_DIR(vaddr)];
+    paddr_t old;
+    int spl;
+
+    spl = splhigh();
+    old = (*leaf)[PT_LEAF(vaddr)];
+    KASSERT(old != 0);
+    KASSERT(dir->npages[PT_DIR(vaddr)] > 0);
+    (*leaf)[PT_LEAF(vaddr)] = 0;
+    as->rss -= PTE_RESIDENT(old);
+    splx(spl);
+    if (--dir->npages[PT_DIR(vaddr)] == 0) {
+        kfree(*leaf);
+        *leaf = NULL;
+        as->pt_bytes -= PT_LEAF_SIZE * sizeof(paddr_t);
+    }
+
+    return old;
+}
+
+
+/*
+ * Bring back the swapped-out PTE_SHARED page at VADDR of AS, whose
+ * entry is *PTEP, so that pt_copy can share its frame. Call with
+ * swap_lock held.
+ */
+static int pt_swapin_shared(struct addrspace *as, vaddr_t vaddr, paddr_t *ptep)
+{
+    paddr_t pte = *ptep;
+    vaddr_t v;
+    int spl, result;
+
+    KASSERT(lock_do_i_hold(swap_lock));
+
+    v = vm_getpage(vaddr);
+    if (v == 0) {
+        return ENOMEM;
+    }
+    result = swap_in(PTE_SWAPSLOT(pte), KVADDR_TO_PADDR(v));
+    if (result) {
+        free_kpages(v);
+        return result;
+    }
+    swap_free(PTE_SWAPSLOT(pte));
+
+    spl = splhigh();
+    *ptep = (KVADDR_TO_PADDR(v) & PAGE_FRAME) | TLBLO_VALID |
+        (pte & (PTE_WRITEABLE | PTE_SHARED | TLBLO_DIRTY));
+    tlbcache_invalidate(as, vaddr);
+    /* a fresh frame has room for its first mapping */
+    result = frame_map(*ptep & PAGE_FRAME, as, vaddr);
+    KASSERT(result == 0);
+    as->rss++;
+    splx(spl);
+
+    return 0;
+}
+
+
+/*
+ * No frames are copied here. Both address spaces share every frame
+ * read-only (TLBLO_DIRTY cleared) and the first write from either
+ * side takes a VM_FAULT_READONLY and gets its own copy in
+ * vm_fault(). Swapped-out pages share their swap slot the same way.
+ *
+ * Pages of shared file mappings (PTE_SHARED) stay shared for good:
+ * their frames are mapped into NEW as they are, dirty or not, and
+ * one that is swapped out is brought back first, since the two
+ * would go separate ways if each paged in its own copy.
+ *
+ * Only the tables OLD actually has are copied, and each leaf only as
+ * far as its last entry in use. On failure NEW keeps what was copied
+ * so far, for pt_destroy to release.
+ */
+int pt_copy(struct addrspace *old, struct addrspace *new)
+{
+    struct pt_dir *odir, *ndir;
+    paddr_t pte;
+    int i, j, k, seen;
 
-    if (as->pagetable[upper] == 0) {
-        as->pagetable = kmalloc(512 * sizeof(paddr_t));
-        for (int i = 0; i < 512; i++) {
-            as->pagetable[upper][i] = 0;
+    /* page-out must not change OLD's entries while we walk them */
+    lock_acquire(swap_lock);
+    for (i = 0; i < PT_TOP_SIZE; i++) {
+        odir = old->pagetable[i];
+        if (odir == NULL) {
+            continue;
+        }
+        ndir = kmalloc(sizeof(struct pt_dir));
+        if (ndir == NULL) {
+            lock_release(swap_lock);
+            return ENOMEM;
         }
-    } 
+        bzero(ndir, sizeof(struct pt_dir));
+        new->pagetable[i] = ndir;
+        new->pt_bytes += sizeof(struct pt_dir);
 
-    as->pagetable[upper][lower] = paddr; 
+        for (j = 0; j < PT_DIR_SIZE; j++) {
+            if (odir->leaf[j] == NULL) {
+                continue;
+            }
+            ndir->leaf[j] = kmalloc(PT_LEAF_SIZE * sizeof(paddr_t));
+            if (ndir->leaf[j] == NULL) {
+                lock_release(swap_lock);
+                return ENOMEM;
+            }
+            bzero(ndir->leaf[j], PT_LEAF_SIZE * sizeof(paddr_t));
+            new->pt_bytes += PT_LEAF_SIZE * sizeof(paddr_t);
+            vmstat_inc(VMSTAT_LEAF_ALLOC);
+
+            seen = 0;
+            for (k = 0; seen < odir->npages[j]; k++) {
+                KASSERT(k < PT_LEAF_SIZE);
+                pte = odir->leaf[j][k];
+                if (pte == 0) {
+                    continue;
+                }
+                if ((pte & (PTE_SWAPPED | PTE_SHARED)) ==
+                    (PTE_SWAPPED | PTE_SHARED)) {
+                    if (pt_swapin_shared(old, PT_VADDR(i, j, k),
+                                         &odir->leaf[j][k])) {
+                        lock_release(swap_lock);
+                        return ENOMEM;
+                    }
+                    pte = odir->leaf[j][k];
+                }
+                if (pte & PTE_SWAPPED) {
+                    swap_dup(PTE_SWAPSLOT(pte));
+                }
+                else {
+                    if (frame_map(pte & PAGE_FRAME, new, PT_VADDR(i, j, k))) {
+                        lock_release(swap_lock);
+                        return ENOMEM;
+                    }
+                    if ((pte & PTE_SHARED) == 0) {
+                        pte &= ~TLBLO_DIRTY;
+                        odir->leaf[j][k] = pte;
+                    }
+                    vmstat_inc(VMSTAT_FORK_PAGES);
+                }
+                ndir->leaf[j][k] = pte;
+                ndir->npages[j]++;
+                new->rss += PTE_RESIDENT(pte);
+                seen++;
+            }
+        }
+    }
+    tlbcache_flush(old);
+    lock_release(swap_lock);
 
     return 0;
 }
 
 
+/*
+ * Release every page and table of AS. The walk skips empty tables
+ * and stops in each leaf after its last entry in use, so the cost
+ * follows the number of pages mapped rather than the size of the
+ * address space; frames go back FRAME_BATCH_MAX at a time.
+ */
+void pt_destroy(struct addrspace *as)
+{
+    paddr_t frames[FRAME_BATCH_MAX];
+    vaddr_t vaddrs[FRAME_BATCH_MAX];
+    struct pt_dir *dir;
+    paddr_t pte;
+    unsigned n;
+    int i, j, k, seen;
+
+    /* keep page-out away from frames we are about to free */
+    lock_acquire(swap_lock);
+    n = 0;
+    for (i = 0; i < PT_TOP_SIZE; i++) {
+        dir = as->pagetable[i];
+        if (dir == NULL) {
+            continue;
+        }
+        for (j = 0; j < PT_DIR_SIZE; j++) {
+            if (dir->leaf[j] == NULL) {
+                continue;
+            }
+            seen = 0;
+            for (k = 0; seen < dir->npages[j]; k++) {
+                KASSERT(k < PT_LEAF_SIZE);
+                pte = dir->leaf[j][k];
+                if (pte == 0) {
+                    continue;
+                }
+                seen++;
+                if (pte & PTE_SWAPPED) {
+                    swap_free(PTE_SWAPSLOT(pte));
+                    continue;
+                }
+                frames[n] = pte & PAGE_FRAME;
+                vaddrs[n] = PT_VADDR(i, j, k);
+                if (++n == FRAME_BATCH_MAX) {
+                    frame_unmap_batch(as, frames, vaddrs, n);
+                    n = 0;
+                }
+            }
+            kfree(dir->leaf[j]);
+        }
+        kfree(dir);
+        as->pagetable[i] = NULL;
+    }
+    frame_unmap_batch(as, frames, vaddrs, n);
+    as->pt_bytes = 0;
+    as->rss = 0;
+    lock_release(swap_lock);
+}
+
+
+void tlbcache_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    struct tlbcache_entry *e = &as->tlbcache[TLBCACHE_INDEX(vaddr)];
+
+    if (e->vpage == (vaddr & PAGE_FRAME)) {
+        e->vpage = 0;
+        e->pte = 0;
+    }
+}
+
+
+void tlbcache_flush(struct addrspace *as)
+{
+    for (int i = 0; i < TLBCACHE_SIZE; i++) {
+        as->tlbcache[i].vpage = 0;
+        as->tlbcache[i].pte = 0;
+    }
+}
+
+
+static unsigned vm_npages; /* see vm_totalpages() */
+
 void vm_bootstrap(void)
 {
     /* Initialise any global components of your VM sub-system here.  
@@ -71,66 +383,1307 @@ void vm_bootstrap(void)
      * You may or may not need to add anything here depending what's
      * provided or required by the assignment spec.
      */
+
+    vaddr_t zero;
+
+    swap_bootstrap();
+    frame_zero_bootstrap();
+
+    zero = alloc_kpages(1);
+    if (zero == 0) {
+        panic("vm: no memory for the zero page\n");
+    }
+    bzero((void *) zero, PAGE_SIZE);
+    vm_zeropage = KVADDR_TO_PADDR(zero);
+    frame_pin(vm_zeropage);
+
+    vm_npages = ram_getsize() / PAGE_SIZE + swap_size();
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress)
+
+unsigned vm_totalpages(void)
 {
-    int spl;
+    return vm_npages;
+}
 
-    if (faulttype == VM_FAULT_READONLY) {
-        return EFAULT;
-    } else if (faultaddress == 0) {
-        return EFAULT;
+
+/*
+ * Stack limit, like RLIMIT_STACK. Read at fault time, so a change
+ * applies to running processes too.
+ */
+static size_t vm_stack_rlimit = 4 * 1024 * 1024;
+
+size_t vm_stacklimit(void)
+{
+    return vm_stack_rlimit;
+}
+
+void vm_setstacklimit(size_t bytes)
+{
+    vm_stack_rlimit = ROUNDUP(bytes, PAGE_SIZE);
+}
+
+
+/*
+ * Resident set limit, in pages, for every process (0 for none). Like
+ * the stack limit it is read at fault time.
+ */
+static unsigned vm_rss_rlimit = 0;
+
+size_t vm_rsslimit(void)
+{
+    return (size_t)vm_rss_rlimit * PAGE_SIZE;
+}
+
+void vm_setrsslimit(size_t bytes)
+{
+    vm_rss_rlimit = DIVROUNDUP(bytes, PAGE_SIZE);
+}
+
+
+/*
+ * Fault-around starts once this many misses in a row have each been
+ * on the page after the one before. The window is capped at half the
+ * TLB so a scan cannot push out everything else.
+ */
+#define FAULTAROUND_RUN 2
+#define FAULTAROUND_MAX (NUM_TLB / 2)
+
+static unsigned vm_faultaround_pages = 8;
+
+unsigned vm_faultaround(void)
+{
+    return vm_faultaround_pages;
+}
+
+void vm_setfaultaround(unsigned pages)
+{
+    vm_faultaround_pages = pages > FAULTAROUND_MAX ? FAULTAROUND_MAX : pages;
+}
+
+
+/*
+ * Region containing any part of the page at VADDR. Segments need not
+ * start on a page boundary, so match on overlap with the page.
+ */
+static struct as_region *vm_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    for (struct as_region *curr = as->head; curr != NULL; curr = curr->next) {
+        if ((vaddr + PAGE_SIZE > curr->vbase) && (vaddr < (curr->vbase + curr->size))) {
+            return curr;
+        }
     }
-    
-    struct addrspace *as = proc_getas();
-    if (as == NULL) {
-        return EFAULT;
+    return NULL;
+}
+
+
+/*
+ * A fault at VADDR (page aligned) just below the stack grows the
+ * stack down to it, if that stays within the stack limit and clear
+ * of the heap's guard gap. Returns the stack region, or NULL if the
+ * fault is not a stack access.
+ */
+static struct as_region *vm_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+    struct as_region *stack = as->stack;
+
+    if (stack == NULL || vaddr >= stack->vbase) {
+        return NULL;
+    }
+    if (USERSTACK - vaddr > vm_stack_rlimit) {
+        return NULL;
+    }
+    for (struct as_region *r = as->head; r != NULL; r = r->next) {
+        if (r != stack && r->vbase < stack->vbase &&
+            vaddr < ROUNDUP(r->vbase + r->size, PAGE_SIZE) + STACK_GUARD) {
+            return NULL;
+        }
     }
 
-    paddr_t pt_entry = pt_lookup(faultaddress);
+    /* both page aligned, so the span grows by exactly this */
+    as->vsize += stack->vbase - vaddr;
+    stack->size += stack->vbase - vaddr;
+    stack->vbase = vaddr;
+    return stack;
+}
 
-    if (pt_entry != 0) {
-        
-        for (struct as_region *curr = as->head; curr != NULL; curr = curr->next) {
-            if ((faultaddress >= curr->vbase) && (faultaddress < (curr->vbase + curr->size))) {
-                if ((curr->loading == 1) || (curr->writeable != 0)) {
-                    pt_entry |= TLBLO_DIRTY;
-                }
-                pt_entry |= TLBLO_VALID;
-                
-                spl = splhigh();
-                tlb_random(faultaddress & PAGE_FRAME, pt_entry);
-                splx(spl);
-                
-                return 0;
+
+/*
+ * Address space IDs. An address space gets an ASID the first time it
+ * is activated in each ASID generation. When they run out the
+ * generation is bumped and the TLB flushed, so entries left tagged
+ * with an old ASID can never match its new owner. Until then a
+ * context switch only reloads the PID field of c0_entryhi. ASID 0 is
+ * not handed out; it is what the processor starts with and what is
+ * used when ASIDs are switched off.
+ *
+ * Like the rest of the VM system this assumes one CPU: a rollover
+ * only flushes the local TLB.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1; /* 0 means "never had an ASID" */
+static uint32_t asid_next = 1;
+static bool asid_enabled = true;
+static uint32_t vm_curasid; /* PID bits currently in c0_entryhi */
+static struct addrspace *vm_lastas; /* last address space activated */
+
+#define TLBHI(vaddr) (((vaddr) & TLBHI_VPAGE) | vm_curasid)
+
+/* TLB counters for the tlbstat menu command */
+static struct {
+    unsigned misses;
+    unsigned switches;
+    unsigned flushes;
+    unsigned rollovers;
+    unsigned prefetched;
+    unsigned superpages;
+    unsigned superloads;
+} tlbstats;
+
+
+/*
+ * TLB entries loaded since the last full flush. Once there have been
+ * NUM_TLB of them, tlb_random most likely replaces a live entry; we
+ * count that as an eviction. (Single-entry invalidations are not
+ * tracked, so this somewhat overcounts.)
+ */
+static unsigned tlb_loaded;
+
+/* Load an entry for VADDR into a random TLB slot. Call at splhigh. */
+static void vm_tlb_load(vaddr_t vaddr, paddr_t tlblo)
+{
+    tlb_random(TLBHI(vaddr), tlblo);
+    vmstat_inc(VMSTAT_TLB_LOAD);
+    if (tlb_loaded < NUM_TLB) {
+        tlb_loaded++;
+    }
+    else {
+        vmstat_inc(VMSTAT_TLB_EVICT);
+    }
+}
+
+
+/* Invalidate every TLB entry. Call at splhigh. */
+void vm_tlb_flush(void)
+{
+    tlb_loaded = 0;
+    for (int i = 0; i < NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i) | vm_curasid, TLBLO_INVALID(), i);
+    }
+    tlbstats.flushes++;
+}
+
+
+/*
+ * Load AS's ASID into the processor, allocating one if it has none
+ * in the current generation. Called by as_activate at splhigh.
+ */
+void vm_tlb_activate(struct addrspace *as)
+{
+    uint32_t asid;
+
+    spinlock_acquire(&asid_lock);
+    if (!asid_enabled) {
+        asid = 0;
+        vm_curasid = 0;
+        vm_tlb_flush();
+    }
+    else {
+        if (as->asid_generation != asid_generation) {
+            if (asid_next == NUM_ASID) {
+                asid_generation++;
+                asid_next = 1;
+                vm_tlb_flush();
+                tlbstats.rollovers++;
             }
+            as->asid = asid_next++;
+            as->asid_generation = asid_generation;
         }
-        return EFAULT;
+        asid = as->asid << TLBHI_PID_SHIFT;
     }
-    
-    for (struct as_region *curr = as->head; curr != NULL; curr = curr->next) {
 
-        if ((faultaddress >= curr->vbase) && (faultaddress < (curr->vbase + curr->size))) {
-            vaddr_t v = alloc_kpages(1);
+    if (as != vm_lastas) {
+        tlbstats.switches++;
+        vm_lastas = as;
+    }
+    vm_curasid = asid;
+    spinlock_release(&asid_lock);
 
-            bzero((void *) v, PAGE_SIZE);
-            paddr_t p = KVADDR_TO_PADDR(v) & PAGE_FRAME;
-            if ((curr->loading == 1) || (curr->writeable != 0)) {
-                p |= TLBLO_DIRTY;
-            }
-            p |= TLBLO_VALID;
-            pt_insert(faultaddress, p);
+    /*
+     * There is no primitive that only loads c0_entryhi; probing for
+     * an address in kseg0, which is never in the TLB, does it as a
+     * side effect.
+     */
+    tlb_probe(TLBHI_INVALID(0) | vm_curasid, 0);
+}
 
-            spl = splhigh();
-            tlb_random(faultaddress & PAGE_FRAME, p);
-            splx(spl);
 
-            return 0;
+void vm_tlb_setasid(bool enabled)
+{
+    spinlock_acquire(&asid_lock);
+    if (enabled && !asid_enabled) {
+        /* start a fresh generation; nobody's ASID is valid any more */
+        asid_generation++;
+        asid_next = 1;
+    }
+    asid_enabled = enabled;
+    spinlock_release(&asid_lock);
+}
+
+
+void vm_tlb_printstats(void)
+{
+    kprintf("TLB misses:           %u\n", tlbstats.misses);
+    kprintf("Context switches:     %u\n", tlbstats.switches);
+    kprintf("Misses per switch:    %u\n",
+            tlbstats.switches ? tlbstats.misses / tlbstats.switches : 0);
+    kprintf("Full TLB flushes:     %u\n", tlbstats.flushes);
+    kprintf("ASID rollovers:       %u\n", tlbstats.rollovers);
+    kprintf("Fault-around loads:   %u (window %u)\n", tlbstats.prefetched,
+            vm_faultaround_pages);
+    kprintf("Superpages made:      %u\n", tlbstats.superpages);
+    kprintf("Superpage loads:      %u\n", tlbstats.superloads);
+    kprintf("ASIDs:                %s\n", asid_enabled ? "on" : "off");
+}
+
+
+void vm_tlb_resetstats(void)
+{
+    bzero(&tlbstats, sizeof(tlbstats));
+}
+
+
+/*
+ * Drop the TLB entry for VADDR in the current address space, if
+ * there is one. Call at splhigh.
+ */
+static void vm_tlb_invalidate(vaddr_t vaddr)
+{
+    int i;
+
+    i = tlb_probe(TLBHI(vaddr), 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i) | vm_curasid, TLBLO_INVALID(), i);
+    }
+}
+
+
+void vm_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+    paddr_t *pte, old;
+    vaddr_t va;
+    bool current;
+    int spl;
+
+    KASSERT((start & PAGE_FRAME) == start);
+    KASSERT((end & PAGE_FRAME) == end);
+
+    current = (as == proc_getas());
+
+    /* page-out must not pick one of these frames while we free it */
+    lock_acquire(swap_lock);
+    for (va = start; va < end; va += PAGE_SIZE) {
+        pte = pt_entry_of(as, va);
+        if (pte == NULL) {
+            /* skip the rest of this leaf table */
+            va = (va | (PT_LEAF_SPAN - 1)) - PAGE_SIZE + 1;
+            continue;
+        }
+
+        if (*pte == 0) {
+            continue;
+        }
+
+        spl = splhigh();
+        old = pt_clear(as, va);
+        tlbcache_invalidate(as, va);
+        if (current && (old & TLBLO_VALID)) {
+            vm_tlb_invalidate(va);
+        }
+        splx(spl);
+
+        if (old & PTE_SWAPPED) {
+            swap_free(PTE_SWAPSLOT(old));
+        }
+        else {
+            frame_unmap(old & PAGE_FRAME, as, va);
         }
     }
+    lock_release(swap_lock);
+
+    if (!current) {
+        /* its entries are tagged with an ASID we can't probe for */
+        spl = splhigh();
+        vm_tlb_flush();
+        splx(spl);
+    }
+}
+
+
+/*
+ * Page-out state passed to the frame_foreach_mapping callbacks.
+ */
+struct vm_evict_args {
+    paddr_t paddr;
+    unsigned slot;
+    unsigned nmappings;
+};
+
+/*
+ * Point one mapping of the victim at its swap slot. Every mapping
+ * after the first takes its own reference to the slot. The software
+ * bits (and TLBLO_DIRTY, which a shared mapping needs) are kept, and
+ * TLBLO_VALID is not, so the TLB never sees this entry.
+ */
+static void vm_evict_mapping(struct addrspace *as, vaddr_t vaddr, void *data)
+{
+    struct vm_evict_args *args = data;
+    paddr_t *pte;
+
+    pte = pt_entry_of(as, vaddr);
+    KASSERT(pte != NULL);
+    KASSERT((*pte & PAGE_FRAME) == args->paddr);
+
+    if (args->nmappings++ > 0) {
+        swap_dup(args->slot);
+    }
+    *pte = PTE_MKSWAP(args->slot) |
+        (*pte & (PTE_WRITEABLE | PTE_SHARED | TLBLO_DIRTY));
+    tlbcache_invalidate(as, vaddr);
+    as->rss--;
+}
+
+/* Undo vm_evict_mapping after a failed write. */
+static void vm_evict_undo(struct addrspace *as, vaddr_t vaddr, void *data)
+{
+    struct vm_evict_args *args = data;
+    paddr_t *pte;
+
+    pte = pt_entry_of(as, vaddr);
+    KASSERT(pte != NULL);
+
+    swap_free(args->slot);
+    *pte = args->paddr | TLBLO_VALID |
+        (*pte & (PTE_WRITEABLE | PTE_SHARED | TLBLO_DIRTY));
+    tlbcache_invalidate(as, vaddr);
+    as->rss++;
+}
+
+
+/*
+ * Victim for reclaim within AS (RSS limit): a clock over AS's own
+ * page table, starting where the last one left off, taking the first
+ * page not recently referenced whose frame nobody else maps. Pages
+ * shared copy-on-write (and the zero page) are left alone, since
+ * paging them out would not shrink anyone's footprint by much.
+ * Call with swap_lock held.
+ */
+static int vm_rss_victim(struct addrspace *as, paddr_t *paddr)
+{
+    struct pt_dir *dir;
+    paddr_t pte;
+    vaddr_t va;
+    unsigned scanned, step;
+
+    KASSERT(lock_do_i_hold(swap_lock));
+
+    va = as->rss_hand;
+    for (scanned = 0; scanned < 2 * (USERSPACETOP / PAGE_SIZE);
+         scanned += step) {
+        dir = as->pagetable[PT_TOP(va)];
+        if (dir == NULL || dir->leaf[PT_DIR(va)] == NULL) {
+            /* on to the next leaf */
+            step = PT_LEAF_SIZE - PT_LEAF(va);
+        }
+        else {
+            step = 1;
+            pte = dir->leaf[PT_DIR(va)][PT_LEAF(va)];
+            if (PTE_RESIDENT(pte) &&
+                frame_refcount(pte & PAGE_FRAME) == 1 &&
+                !frame_clear_referenced(pte & PAGE_FRAME)) {
+                *paddr = pte & PAGE_FRAME;
+                as->rss_hand = va + PAGE_SIZE;
+                return 0;
+            }
+        }
+        va += step * PAGE_SIZE;
+        if (va >= USERSPACETOP) {
+            va = 0;
+        }
+    }
+    return ENOMEM;
+}
+
+
+/*
+ * Note whether a mapping of a page-out candidate is PTE_SHARED.
+ */
+static void vm_evict_check(struct addrspace *as, vaddr_t vaddr, void *data)
+{
+    bool *shared = data;
+    paddr_t *pte;
+
+    pte = pt_entry_of(as, vaddr);
+    KASSERT(pte != NULL);
+    if (*pte & PTE_SHARED) {
+        *shared = true;
+    }
+}
+
+/*
+ * Pick a victim with frame_victim, passing over frames that more
+ * than one shared mapping uses: once in swap, each sharer would page
+ * in a copy of its own. Call with swap_lock held, which keeps the
+ * frame's mappings from changing under us.
+ */
+#define VM_EVICT_TRIES 16
+static int vm_evict_victim(paddr_t *paddr)
+{
+    unsigned tries;
+    bool shared;
+    int result;
+
+    KASSERT(lock_do_i_hold(swap_lock));
+
+    for (tries = 0; tries < VM_EVICT_TRIES; tries++) {
+        result = frame_victim(paddr);
+        if (result) {
+            return result;
+        }
+        shared = false;
+        if (frame_foreach_mapping(*paddr, vm_evict_check, &shared) <= 1 ||
+            !shared) {
+            return 0;
+        }
+    }
+    return ENOMEM;
+}
+
+
+/*
+ * Page out one user page to make room: one of AS's own pages if AS
+ * is not NULL (see vm_rss_victim), else whichever page the clock in
+ * frame_victim() picks (see vm_evict_victim). The reverse map gives
+ * every PTE that maps it, so frames shared copy-on-write can go too;
+ * the sharers then
+ * share the swap slot. The PTEs are switched to the swap slot before the
+ * write so that an access during the write faults and waits in
+ * vm_pagein() for swap_lock.
+ *
+ * Flushing the whole TLB (rather than only the victim's entries) is
+ * what makes the clock's reference bits meaningful: every page whose
+ * bit was cleared has to refill, and so re-reference, before use.
+ */
+static int vm_evict(struct addrspace *as)
+{
+    struct vm_evict_args args;
+    bool held;
+    int spl, result;
+
+    held = lock_do_i_hold(swap_lock);
+    if (!held) {
+        lock_acquire(swap_lock);
+    }
+
+    result = swap_alloc(&args.slot);
+    if (result) {
+        if (!held) {
+            lock_release(swap_lock);
+        }
+        return ENOMEM;
+    }
+
+    if (as != NULL) {
+        result = vm_rss_victim(as, &args.paddr);
+    }
+    else {
+        result = vm_evict_victim(&args.paddr);
+    }
+    if (result) {
+        swap_free(args.slot);
+        if (!held) {
+            lock_release(swap_lock);
+        }
+        return result;
+    }
+
+    spl = splhigh();
+    args.nmappings = 0;
+    if (frame_foreach_mapping(args.paddr, vm_evict_mapping, &args) == 0) {
+        /* freed since it was picked; that made room too */
+        splx(spl);
+        swap_free(args.slot);
+        if (!held) {
+            lock_release(swap_lock);
+        }
+        return 0;
+    }
+    vm_tlb_flush();
+    splx(spl);
+
+    result = swap_out(args.slot, args.paddr);
+    if (result) {
+        kprintf("vm: page-out failed: %s\n", strerror(result));
+        spl = splhigh();
+        frame_foreach_mapping(args.paddr, vm_evict_undo, &args);
+        splx(spl);
+    }
+    else {
+        frame_unmap_all(args.paddr);
+    }
+
+    if (!held) {
+        lock_release(swap_lock);
+    }
+    return result;
+}
+
+
+/*
+ * Page out one user page for alloc_kpages, so that page tables,
+ * reverse-map nodes, kernel stacks and buffers can still be had when
+ * user pages fill memory. Paging out sleeps, so it is only done when
+ * the caller could sleep anyway: not in an interrupt, at splhigh or
+ * under a spinlock. Nor under swap_lock, whose holders may be in the
+ * middle of changing the very mappings page-out would look at.
+ * ENOMEM if nothing could be paged out.
+ */
+int vm_reclaim(void)
+{
+    if (swap_lock == NULL || curthread->t_in_interrupt ||
+        curthread->t_curspl > 0 || curcpu->c_spinlocks > 0 ||
+        lock_do_i_hold(swap_lock)) {
+        return ENOMEM;
+    }
+    return vm_evict(NULL);
+}
+
+
+/*
+ * Get a frame for the user page at VADDR (colored to match it),
+ * paging something out if memory is full. Returns 0 if there is
+ * neither memory nor swap left.
+ */
+static vaddr_t vm_getpage(vaddr_t vaddr)
+{
+    vaddr_t v;
+
+    v = alloc_colored_kpage(vaddr);
+    while (v == 0) {
+        if (vm_evict(NULL)) {
+            return 0;
+        }
+        v = alloc_colored_kpage(vaddr);
+    }
+    return v;
+}
+
+
+/*
+ * Make room in AS's resident set for NPAGES more pages if that would
+ * take it over the RSS limit, by paging out its own pages. ENOMEM if
+ * it cannot (no swap, or nothing of its own to page out).
+ */
+static int vm_rss_reserve(struct addrspace *as, unsigned npages)
+{
+    while (vm_rss_rlimit != 0 && as->rss + npages > vm_rss_rlimit) {
+        if (vm_evict(as)) {
+            return ENOMEM;
+        }
+        vmstat_inc(VMSTAT_RSS_RECLAIM);
+    }
+    return 0;
+}
+
+
+/* vm_getpage for a page of zeros; see alloc_zeroed_kpage */
+static vaddr_t vm_getzeroedpage(vaddr_t vaddr)
+{
+    vaddr_t v;
+
+    v = alloc_zeroed_kpage(vaddr);
+    if (v == 0) {
+        v = vm_getpage(vaddr);
+        if (v != 0) {
+            bzero((void *) v, PAGE_SIZE);
+        }
+    }
+    return v;
+}
+
+
+/*
+ * Write page VADDR of REGION from the frame at KVADDR to the file,
+ * stopping at the end of the file data.
+ */
+static int vm_writepage(struct as_region *region, vaddr_t vaddr, vaddr_t kvaddr)
+{
+    struct iovec iov;
+    struct uio ku;
+    vaddr_t end;
+
+    end = vaddr + PAGE_SIZE;
+    if (end > region->vbase + region->filesize) {
+        end = region->vbase + region->filesize;
+    }
+    if (vaddr >= end) {
+        return 0;
+    }
+
+    uio_kinit(&iov, &ku, (void *) kvaddr, end - vaddr,
+              region->file_offset + (vaddr - region->vbase), UIO_WRITE);
+    return VOP_WRITE(region->vn, &ku);
+}
+
+
+/*
+ * Pages count as modified if TLBLO_DIRTY is set; page-out keeps the
+ * bit. Each dirty page is copied (or, if swapped out, read) into a
+ * bounce frame under swap_lock, and written from there with the lock
+ * dropped: VOP_WRITE takes vfs_biglock, and a thread holding that
+ * can fault in uiomove and wait for swap_lock, so swap_lock is
+ * never held across file I/O.
+ *
+ * TLBLO_DIRTY is cleared (and the TLB entry dropped) before the copy
+ * is taken, so a write made while the copy goes out faults and marks
+ * the page dirty again. If the write fails the bit is put back.
+ */
+int vm_writeback(struct addrspace *as, struct as_region *region)
+{
+    paddr_t *pte, old;
+    vaddr_t va, bounce;
+    bool current;
+    int spl, result;
+
+    KASSERT(region->vn != NULL);
+    KASSERT((region->vbase & PAGE_FRAME) == region->vbase);
+
+    current = (as == proc_getas());
+    bounce = 0;
+    result = 0;
+
+    for (va = region->vbase; va < region->vbase + region->filesize;
+         va += PAGE_SIZE) {
+        /* hold the page still while we copy it */
+        lock_acquire(swap_lock);
+        pte = pt_entry_of(as, va);
+        if (pte == NULL || (*pte & TLBLO_DIRTY) == 0) {
+            lock_release(swap_lock);
+            continue;
+        }
+
+        if (bounce == 0) {
+            /* may page out; *pte is read again below */
+            bounce = vm_getpage(0); /* any color */
+            if (bounce == 0) {
+                lock_release(swap_lock);
+                result = ENOMEM;
+                break;
+            }
+        }
+
+        spl = splhigh();
+        old = *pte;
+        *pte &= ~TLBLO_DIRTY;
+        tlbcache_invalidate(as, va);
+        if (current) {
+            vm_tlb_invalidate(va);
+        }
+        else {
+            /* its entries are tagged with an ASID we can't probe for */
+            vm_tlb_flush();
+        }
+        splx(spl);
+
+        if (old & PTE_SWAPPED) {
+            result = swap_in(PTE_SWAPSLOT(old), KVADDR_TO_PADDR(bounce));
+        }
+        else {
+            memcpy((void *) bounce, (void *) PADDR_TO_KVADDR(old & PAGE_FRAME),
+                   PAGE_SIZE);
+        }
+        lock_release(swap_lock);
+
+        if (result == 0) {
+            result = vm_writepage(region, va, bounce);
+        }
+        if (result) {
+            /* still needs writing back */
+            lock_acquire(swap_lock);
+            pte = pt_entry_of(as, va);
+            if (pte != NULL && *pte != 0) {
+                spl = splhigh();
+                *pte |= TLBLO_DIRTY;
+                tlbcache_invalidate(as, va);
+                splx(spl);
+            }
+            lock_release(swap_lock);
+            break;
+        }
+    }
+
+    if (bounce != 0) {
+        free_kpages(bounce);
+    }
+    return result;
+}
+
+
+/* PTE protection bits for a new page in REGION */
+static paddr_t vm_region_bits(struct as_region *region)
+{
+    if (region->shared) {
+        /* leave TLBLO_DIRTY for the first write to set */
+        return PTE_SHARED | PTE_WRITEABLE | TLBLO_VALID;
+    }
+    if ((region->loading == 1) || (region->writeable != 0)) {
+        return PTE_WRITEABLE | TLBLO_DIRTY | TLBLO_VALID;
+    }
+    return TLBLO_VALID;
+}
+
+
+/*
+ * Write fault on a page whose PTE is not dirty. If the region is
+ * writeable this is a copy-on-write page shared after fork(): take
+ * a private copy of the frame unless we are already the only user.
+ */
+static int vm_copy_on_write(struct addrspace *as, vaddr_t faultaddress)
+{
+    paddr_t pt_entry, oldframe;
+    vaddr_t v = 0;
+    int spl, index, result;
+
+    pt_entry = pt_lookup(faultaddress);
+    if ((pt_entry & TLBLO_VALID) == 0) {
+        /* paged out under us; fault again and page it in */
+        return 0;
+    }
+    if ((pt_entry & PTE_WRITEABLE) == 0) {
+        return EFAULT;
+    }
+
+    oldframe = pt_entry & PAGE_FRAME;
+    if ((pt_entry & PTE_SHARED) == 0 && frame_refcount(oldframe) > 1) {
+        if (oldframe == vm_zeropage) {
+            /* the page becomes resident only now */
+            result = vm_rss_reserve(as, 1);
+            if (result) {
+                return result;
+            }
+            v = vm_getzeroedpage(faultaddress);
+        }
+        else {
+            v = vm_getpage(faultaddress);
+            if (v != 0) {
+                memmove((void *) v, (void *) PADDR_TO_KVADDR(oldframe),
+                        PAGE_SIZE);
+            }
+        }
+        if (v == 0) {
+            return ENOMEM;
+        }
+        vmstat_inc(VMSTAT_COW_COPY);
+    }
+
+    /*
+     * Page-out must not see the reverse map between switching the
+     * PTE to the copy and dropping the old frame's mapping.
+     */
+    lock_acquire(swap_lock);
+    spl = splhigh();
+    if (pt_lookup(faultaddress) != pt_entry) {
+        /* the page moved while we were copying; retry the access */
+        splx(spl);
+        lock_release(swap_lock);
+        if (v != 0) {
+            free_kpages(v);
+        }
+        return 0;
+    }
+    if (v != 0) {
+        pt_entry = (KVADDR_TO_PADDR(v) & PAGE_FRAME) | PTE_WRITEABLE | TLBLO_VALID;
+    }
+    pt_entry |= TLBLO_DIRTY;
+
+    /* the leaf exists, so this cannot fail */
+    result = pt_update(faultaddress, pt_entry);
+    KASSERT(result == 0);
+
+    index = tlb_probe(TLBHI(faultaddress), 0);
+    if (index >= 0) {
+        tlb_write(TLBHI(faultaddress), PTE_TLBLO(pt_entry), index);
+    } else {
+        vm_tlb_load(faultaddress, PTE_TLBLO(pt_entry));
+    }
+    if (v != 0) {
+        /* a fresh frame has room for its first mapping */
+        result = frame_map(pt_entry & PAGE_FRAME, as, faultaddress);
+        KASSERT(result == 0);
+    }
+    else {
+        frame_touch(pt_entry & PAGE_FRAME);
+    }
+    splx(spl);
+
+    if (v != 0) {
+        /* drops our reference to the shared frame */
+        frame_unmap(oldframe, as, faultaddress);
+    }
+    lock_release(swap_lock);
+
+    return 0;
+}
+
+
+/*
+ * Bring a swapped-out page back in.
+ */
+static int vm_pagein(struct addrspace *as, vaddr_t faultaddress)
+{
+    paddr_t pt_entry;
+    unsigned slot;
+    vaddr_t v;
+    int spl, result;
+
+    lock_acquire(swap_lock);
+
+    pt_entry = pt_lookup(faultaddress);
+    if ((pt_entry & PTE_SWAPPED) == 0) {
+        lock_release(swap_lock);
+        return 0;
+    }
+    slot = PTE_SWAPSLOT(pt_entry);
+
+    result = vm_rss_reserve(as, 1);
+    if (result) {
+        lock_release(swap_lock);
+        return result;
+    }
+
+    v = vm_getpage(faultaddress);
+    if (v == 0) {
+        lock_release(swap_lock);
+        return ENOMEM;
+    }
+
+    result = swap_in(slot, KVADDR_TO_PADDR(v));
+    if (result) {
+        free_kpages(v);
+        lock_release(swap_lock);
+        return result;
+    }
+    swap_free(slot);
+
+    if (pt_entry & PTE_SHARED) {
+        /* TLBLO_DIRTY still means "not yet written back" */
+        pt_entry = (KVADDR_TO_PADDR(v) & PAGE_FRAME) | TLBLO_VALID |
+            (pt_entry & (PTE_WRITEABLE | PTE_SHARED | TLBLO_DIRTY));
+    }
+    else {
+        pt_entry = (KVADDR_TO_PADDR(v) & PAGE_FRAME) | TLBLO_VALID |
+            ((pt_entry & PTE_WRITEABLE) ? (PTE_WRITEABLE | TLBLO_DIRTY) : 0);
+    }
+    result = pt_update(faultaddress, pt_entry);
+    KASSERT(result == 0);
+
+    spl = splhigh();
+    vm_tlb_load(faultaddress, PTE_TLBLO(pt_entry));
+    result = frame_map(pt_entry & PAGE_FRAME, as, faultaddress);
+    KASSERT(result == 0);
+    splx(spl);
+
+    lock_release(swap_lock);
+    return 0;
+}
+
+
+/*
+ * Read the file-backed part of the page at VADDR in REGION into the
+ * (already zeroed) frame at KVADDR. The part of the page before the
+ * segment starts or past its file data stays zero.
+ */
+static int vm_readpage(struct as_region *region, vaddr_t vaddr, vaddr_t kvaddr)
+{
+    struct iovec iov;
+    struct uio ku;
+    vaddr_t start, end;
+    int result;
+
+    start = vaddr < region->vbase ? region->vbase : vaddr;
+    end = vaddr + PAGE_SIZE;
+    if (end > region->vbase + region->filesize) {
+        end = region->vbase + region->filesize;
+    }
+    if (start >= end) {
+        /* all BSS */
+        return 0;
+    }
+
+    uio_kinit(&iov, &ku, (void *) (kvaddr + (start - vaddr)), end - start,
+              region->file_offset + (start - region->vbase), UIO_READ);
+    result = VOP_READ(region->vn, &ku);
+    if (result) {
+        return result;
+    }
+    if (ku.uio_resid != 0) {
+        kprintf("vm: short read on segment - file truncated?\n");
+        return EIO;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Map the zero page at FAULTADDRESS for a read of untouched anonymous
+ * memory. It goes in without TLBLO_DIRTY, so the first write takes
+ * the copy-on-write path and gets a private frame.
+ */
+static int vm_zerofill(struct addrspace *as, struct as_region *region,
+                       vaddr_t faultaddress)
+{
+    paddr_t p;
+    int spl, result;
+
+    p = vm_zeropage | (vm_region_bits(region) & ~TLBLO_DIRTY);
+
+    /* the zero page is pinned; this only counts the mapping */
+    (void)frame_map(vm_zeropage, as, faultaddress);
+    result = pt_insert(faultaddress, p);
+    if (result) {
+        frame_unmap(vm_zeropage, as, faultaddress);
+        return result;
+    }
+    vmstat_inc(VMSTAT_ZERO_FILL);
+
+    spl = splhigh();
+    vm_tlb_load(faultaddress, PTE_TLBLO(p));
+    splx(spl);
+
+    return 0;
+}
+
+
+/*
+ * Software superpages. The TLB only maps 4k pages, so the gain here
+ * is in the fault path rather than in TLB reach: the first write to
+ * an aligned SUPERPAGE_SIZE chunk of a big anonymous region fills
+ * the whole chunk from one contiguous block of frames, and a TLB
+ * miss on any page of it loads every page of the chunk at once.
+ *
+ * The pages are ordinary frames once made (see frame_alloc_block)
+ * and are copied, shared and paged out one by one; PTE_SUPER only
+ * says the neighbours are probably there too.
+ */
+#define SUPERPAGE_ORDER 4
+#define SUPERPAGE_PAGES (1 << SUPERPAGE_ORDER)
+#define SUPERPAGE_SIZE  (SUPERPAGE_PAGES * PAGE_SIZE)
+#define SUPERPAGE_MIN_REGION (4 * SUPERPAGE_SIZE)
+
+/*
+ * Load the pages of the superpage chunk around VADDR that are in
+ * memory into the TLB. Call at splhigh.
+ */
+static void vm_super_refill(struct addrspace *as, vaddr_t vaddr)
+{
+    vaddr_t base, va;
+    paddr_t *pte;
+    int i;
+
+    base = vaddr & ~(vaddr_t)(SUPERPAGE_SIZE - 1);
+    pte = pt_entry_of(as, base);
+    KASSERT(pte != NULL);
+
+    for (i = 0; i < SUPERPAGE_PAGES; i++) {
+        va = base + i * PAGE_SIZE;
+        if (va == vaddr || (pte[i] & TLBLO_VALID) == 0) {
+            continue;
+        }
+        if (tlb_probe(TLBHI(va), 0) >= 0) {
+            continue;
+        }
+        vm_tlb_load(va, PTE_TLBLO(pte[i]));
+        frame_touch(pte[i] & PAGE_FRAME);
+        tlbstats.superloads++;
+    }
+}
+
+
+/*
+ * Fill the chunk around FAULTADDRESS as a superpage, if REGION is a
+ * big anonymous one, the chunk lies wholly in its zero-filled part
+ * and none of it has been touched. Returns ENOMEM when the caller
+ * should fall back to a single page (no contiguous block free, or
+ * the chunk is not suitable).
+ */
+static int vm_super_newpage(struct addrspace *as, struct as_region *region,
+                            vaddr_t faultaddress)
+{
+    vaddr_t base;
+    paddr_t block, bits, *pte;
+    int i, spl, result;
+
+    base = faultaddress & ~(vaddr_t)(SUPERPAGE_SIZE - 1);
+    if (vm_rss_rlimit != 0 && as->rss + SUPERPAGE_PAGES > vm_rss_rlimit) {
+        /* not worth paging out a whole chunk's worth for */
+        return ENOMEM;
+    }
+    if (region == as->stack || region->shared ||
+        region->size < SUPERPAGE_MIN_REGION ||
+        base < region->vbase + region->filesize ||
+        base + SUPERPAGE_SIZE > region->vbase + region->size) {
+        return ENOMEM;
+    }
+
+    /* a chunk never straddles a leaf, so its entries are contiguous */
+    pte = pt_entry_of(as, base);
+    for (i = 0; pte != NULL && i < SUPERPAGE_PAGES; i++) {
+        if (pte[i] != 0) {
+            return ENOMEM;
+        }
+    }
+
+    block = frame_alloc_block(SUPERPAGE_ORDER);
+    if (block == 0) {
+        return ENOMEM;
+    }
+    bzero((void *) PADDR_TO_KVADDR(block), SUPERPAGE_SIZE);
+    bits = vm_region_bits(region) | PTE_SUPER;
+
+    /* the first insert allocates the leaf; the rest cannot fail */
+    result = pt_insert(base, block | bits);
+    if (result) {
+        for (i = 0; i < SUPERPAGE_PAGES; i++) {
+            free_kpages(PADDR_TO_KVADDR(block + i * PAGE_SIZE));
+        }
+        return result;
+    }
+
+    spl = splhigh();
+    for (i = 0; i < SUPERPAGE_PAGES; i++) {
+        if (i > 0) {
+            result = pt_insert(base + i * PAGE_SIZE,
+                               (block + i * PAGE_SIZE) | bits);
+            KASSERT(result == 0);
+        }
+        result = frame_map(block + i * PAGE_SIZE, as, base + i * PAGE_SIZE);
+        KASSERT(result == 0);
+    }
+    vm_tlb_load(faultaddress,
+                PTE_TLBLO((block + (faultaddress - base)) | bits));
+    vm_super_refill(as, faultaddress);
+    tlbstats.superpages++;
+    vmstat_inc(VMSTAT_ZERO_FILL);
+    splx(spl);
+
+    return 0;
+}
+
+
+/*
+ * First touch of a page: give it a fresh zeroed frame, and read in
+ * its contents if the region is backed by a file. Reads of pages
+ * with nothing from the file in them just get the zero page, except
+ * in shared mappings, where fork has to find a frame to share.
+ */
+static int vm_newpage(struct addrspace *as, struct as_region *region,
+                      vaddr_t faultaddress, int faulttype)
+{
+    vaddr_t v;
+    paddr_t p;
+    int spl, result;
+
+    if (faulttype == VM_FAULT_READ && !region->shared &&
+        (region->vn == NULL ||
+         faultaddress >= region->vbase + region->filesize)) {
+        return vm_zerofill(as, region, faultaddress);
+    }
+    if (vm_super_newpage(as, region, faultaddress) == 0) {
+        return 0;
+    }
+
+    result = vm_rss_reserve(as, 1);
+    if (result) {
+        return result;
+    }
+
+    v = vm_getzeroedpage(faultaddress);
+    if (v == 0) {
+        return ENOMEM;
+    }
+
+    if (region->vn != NULL) {
+        result = vm_readpage(region, faultaddress, v);
+        if (result) {
+            free_kpages(v);
+            return result;
+        }
+    }
+    else {
+        vmstat_inc(VMSTAT_ZERO_FILL);
+    }
+
+    p = (KVADDR_TO_PADDR(v) & PAGE_FRAME) | vm_region_bits(region);
+    if (region->shared && faulttype == VM_FAULT_WRITE) {
+        /* about to be written; save the second fault */
+        p |= TLBLO_DIRTY;
+    }
+    result = pt_insert(faultaddress, p);
+    if (result) {
+        free_kpages(v);
+        return result;
+    }
+
+    spl = splhigh();
+    vm_tlb_load(faultaddress, PTE_TLBLO(p));
+    result = frame_map(p & PAGE_FRAME, as, faultaddress);
+    KASSERT(result == 0);
+    splx(spl);
+
+    return 0;
+}
+
+
+/*
+ * Sequential-access detector: note a TLB miss on FAULTADDRESS and
+ * say whether it continues a run of misses on ascending pages.
+ */
+static bool vm_fault_sequential(struct addrspace *as, vaddr_t faultaddress)
+{
+    if (faultaddress == as->fault_last + PAGE_SIZE) {
+        as->fault_run++;
+    }
+    else {
+        as->fault_run = 0;
+    }
+    as->fault_last = faultaddress;
+
+    return as->fault_run + 1 >= FAULTAROUND_RUN;
+}
+
+
+/*
+ * Load the pages after FAULTADDRESS in its region into the TLB, as
+ * far as the fault-around window goes, stopping at the first one not
+ * in memory. Call at splhigh, so page-out cannot take a frame before
+ * its entry is loaded. Pages already in the TLB are skipped; two
+ * entries for one page would be a machine check.
+ */
+static void vm_fault_around(struct addrspace *as, vaddr_t faultaddress)
+{
+    struct as_region *region;
+    vaddr_t va, end;
+    paddr_t *pte;
+    unsigned i;
+
+    region = vm_find_region(as, faultaddress);
+    if (region == NULL) {
+        return;
+    }
+    end = region->vbase + region->size;
+
+    for (i = 1; i <= vm_faultaround_pages; i++) {
+        va = faultaddress + i * PAGE_SIZE;
+        if (va >= end || va >= USERSPACETOP) {
+            break;
+        }
+        pte = pt_entry_of(as, va);
+        if (pte == NULL || (*pte & TLBLO_VALID) == 0) {
+            break;
+        }
+        if (tlb_probe(TLBHI(va), 0) >= 0) {
+            continue;
+        }
+        vm_tlb_load(va, PTE_TLBLO(*pte));
+        frame_touch(*pte & PAGE_FRAME);
+        tlbstats.prefetched++;
+    }
+}
+
+
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    bool sequential;
+    struct tlbcache_entry *cached;
+    struct as_region *region;
+    paddr_t pt_entry;
+    int spl;
+
+    if (faultaddress == 0) {
+        return EFAULT;
+    }
+    
+    struct addrspace *as = proc_getas();
+    if (as == NULL) {
+        return EFAULT;
+    }
+
+    faultaddress &= PAGE_FRAME;
+
+    if (faulttype == VM_FAULT_READONLY) {
+        vmstat_inc(VMSTAT_READONLY_FAULT);
+        return vm_copy_on_write(as, faultaddress);
+    }
+    tlbstats.misses++;
+    vmstat_inc(VMSTAT_TLB_MISS);
+    sequential = vm_fault_sequential(as, faultaddress);
+
+    /*
+     * TLB refill fast path: the software TLB cache, then the page
+     * table. The PTE already carries its permissions, so no region
+     * lookup is needed. Interrupts stay off from the lookup until
+     * the entry is loaded so page-out cannot take the frame in
+     * between.
+     */
+    spl = splhigh();
+    cached = &as->tlbcache[TLBCACHE_INDEX(faultaddress)];
+    if (cached->vpage == faultaddress) {
+        pt_entry = cached->pte;
+    }
+    else {
+        pt_entry = pt_lookup(faultaddress);
+        if (pt_entry & TLBLO_VALID) {
+            cached->vpage = faultaddress;
+            cached->pte = pt_entry;
+        }
+    }
+
+    if (pt_entry & TLBLO_VALID) {
+        if ((faulttype == VM_FAULT_WRITE) &&
+            ((pt_entry & (PTE_WRITEABLE | TLBLO_DIRTY)) == PTE_WRITEABLE)) {
+            /* break the sharing now rather than take a second fault */
+            splx(spl);
+            return vm_copy_on_write(as, faultaddress);
+        }
+
+        vm_tlb_load(faultaddress, PTE_TLBLO(pt_entry));
+        frame_touch(pt_entry & PAGE_FRAME);
+        if (pt_entry & PTE_SUPER) {
+            vm_super_refill(as, faultaddress);
+        }
+        else if (sequential && vm_faultaround_pages > 0) {
+            vm_fault_around(as, faultaddress);
+        }
+        splx(spl);
+
+        return 0;
+    }
+    splx(spl);
+
+    if (pt_entry & PTE_SWAPPED) {
+        return vm_pagein(as, faultaddress);
+    }
+
+    region = vm_find_region(as, faultaddress);
+    if (region == NULL) {
+        region = vm_grow_stack(as, faultaddress);
+    }
+    if (region == NULL) {
+        return EFAULT;
+    }
 
-    return EFAULT;
+    return vm_newpage(as, region, faultaddress, faulttype);
 }
 
 /*
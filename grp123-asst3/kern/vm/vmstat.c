@@ -0,0 +1,107 @@
+/*
+ * VM event counters, one row per cpu.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+#include <vmstat.h>
+
+#define VMSTAT_MAXCPUS 32 /* most cpus sys161 can have */
+
+static const char *const vmstat_names[VMSTAT_NCOUNTERS] = {
+        "TLB misses",
+        "Read-only faults",
+        "Zero-fill faults",
+        "Page-table leaves",
+        "Frames allocated",
+        "Frames freed",
+        "Fork COW pages",
+        "COW copies",
+        "TLB loads",
+        "TLB evictions",
+        "Zero pool hits",
+        "Zero pool misses",
+        "Zeroed by zerod",
+        "Colored frames",
+        "Color misses",
+        "RSS limit page-outs",
+};
+
+static unsigned vmstats[VMSTAT_MAXCPUS][VMSTAT_NCOUNTERS];
+
+/*
+ * Interrupts are off while counting so we stay on this cpu and an
+ * interrupt handler cannot lose our update. Before curcpu is set up
+ * at boot there is only cpu 0.
+ */
+void
+vmstat_add(enum vmstat_counter counter, unsigned n)
+{
+        unsigned cpu;
+        int spl;
+
+        KASSERT(counter < VMSTAT_NCOUNTERS);
+
+        spl = splhigh();
+        cpu = 0;
+        if (CURCPU_EXISTS()) {
+                cpu = curcpu->c_number;
+                KASSERT(cpu < VMSTAT_MAXCPUS);
+        }
+        vmstats[cpu][counter] += n;
+        splx(spl);
+}
+
+void
+vmstat_print(void)
+{
+        unsigned i, cpu, ncpus, total, hits, misses;
+
+        /* only show the cpus that have counted anything */
+        ncpus = 1;
+        for (cpu = 1; cpu < VMSTAT_MAXCPUS; cpu++) {
+                for (i = 0; i < VMSTAT_NCOUNTERS; i++) {
+                        if (vmstats[cpu][i] != 0) {
+                                ncpus = cpu + 1;
+                                break;
+                        }
+                }
+        }
+
+        for (i = 0; i < VMSTAT_NCOUNTERS; i++) {
+                total = 0;
+                for (cpu = 0; cpu < ncpus; cpu++) {
+                        total += vmstats[cpu][i];
+                }
+                kprintf("%-20s %10u", vmstat_names[i], total);
+                if (ncpus > 1) {
+                        for (cpu = 0; cpu < ncpus; cpu++) {
+                                kprintf(" %u", vmstats[cpu][i]);
+                        }
+                }
+                kprintf("\n");
+        }
+
+        hits = misses = 0;
+        for (cpu = 0; cpu < ncpus; cpu++) {
+                hits += vmstats[cpu][VMSTAT_ZERO_HIT];
+                misses += vmstats[cpu][VMSTAT_ZERO_MISS];
+        }
+        if (hits + misses > 0) {
+                kprintf("%-20s %9u%%\n", "Zero pool hit rate",
+                        hits * 100 / (hits + misses));
+        }
+}
+
+void
+vmstat_reset(void)
+{
+        int spl;
+
+        spl = splhigh();
+        bzero(vmstats, sizeof(vmstats));
+        splx(spl);
+}
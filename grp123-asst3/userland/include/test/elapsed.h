@@ -0,0 +1,13 @@
+/*
+ * elapsed.h
+ *
+ *	Timing for the benchmark modes of the test programs.
+ */
+
+#include <sys/types.h>
+
+/*
+ * Microseconds since STARTSECS/STARTNSECS, as returned by __time().
+ * Never 0, so it can be divided by.
+ */
+unsigned long long elapsed(time_t startsecs, unsigned long startnsecs);
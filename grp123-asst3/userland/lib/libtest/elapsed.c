@@ -0,0 +1,22 @@
+/*
+ * elapsed.c
+ *
+ *	Timing for the benchmark modes of the test programs.
+ */
+
+#include <unistd.h>
+#include <test/elapsed.h>
+
+unsigned long long
+elapsed(time_t startsecs, unsigned long startnsecs)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned long long usecs;
+
+	__time(&secs, &nsecs);
+	usecs = (unsigned long long)(secs - startsecs) * 1000000
+		+ nsecs / 1000;
+	usecs -= startnsecs / 1000;
+	return usecs == 0 ? 1 : usecs;
+}
@@ -37,6 +37,16 @@
  *
  *      Intended for the file system assignment. Should run (on SFS)
  *      when that assignment is complete.
+ *
+ *      "dirtest -b" instead times name lookups with thousands of
+ *      vnodes loaded. A process can only hold BENCHFILES files open
+ *      (OPEN_MAX), so it takes a chain of BENCHLEVELS processes: each
+ *      creates and holds open BENCHFILES files of its own directory,
+ *      then forks the next, and waits for it. At a few levels the
+ *      process times opening and closing its files by name
+ *      BENCHROUNDS times; each open has to find its inode among all
+ *      the vnodes the chain holds loaded, while the directory it
+ *      searches stays the same size.
  */
 
 #include <sys/types.h>
@@ -44,17 +54,153 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <err.h>
+#include <sys/wait.h>
+#include <test/elapsed.h>
 
 #define MAXLEVELS       5
 
+#define BENCHDIR        "benchdir"
+#define BENCHFILES      100	/* per process; must be well under OPEN_MAX */
+#define BENCHLEVELS     20	/* processes in the chain */
+#define BENCHROUNDS     20
+
+/* levels (counting from 1) at which lookups are timed */
+static const int benchtimed[] = { 1, 2, 5, 10, 20 };
+
+/*
+ * Open and close each file of LEVEL's directory BENCHROUNDS times,
+ * and report the rate.
+ */
+static
+void
+bench_time(int level)
+{
+	char name[32];
+	int i, r, fd;
+	time_t startsecs;
+	unsigned long startnsecs;
+	unsigned long long usecs, nopens;
+
+	__time(&startsecs, &startnsecs);
+	for (r=0; r<BENCHROUNDS; r++) {
+		for (i=0; i<BENCHFILES; i++) {
+			snprintf(name, sizeof(name), "%s/d%d/f%d",
+				 BENCHDIR, level, i);
+			fd = open(name, O_RDONLY);
+			if (fd < 0) {
+				err(1, "%s: open", name);
+			}
+			close(fd);
+		}
+	}
+	usecs = elapsed(startsecs, startnsecs);
+
+	nopens = (unsigned long long)BENCHFILES * BENCHROUNDS;
+	printf("dirtest: %d files open: %llu opens in %llu.%06llu "
+	       "seconds, %llu opens/sec\n", (level + 1) * BENCHFILES,
+	       nopens, usecs / 1000000, usecs % 1000000,
+	       nopens * 1000000 / usecs);
+}
+
+/*
+ * One process of the chain: hold BENCHFILES files open in a
+ * directory of our own, time lookups if this is one of the levels
+ * in benchtimed, and leave the files open while the next level runs.
+ */
+static
+void
+bench_level(int level)
+{
+	char name[32];
+	int fds[BENCHFILES];
+	int i, status;
+	pid_t pid;
+
+	snprintf(name, sizeof(name), "%s/d%d", BENCHDIR, level);
+	if (mkdir(name, 0755)) {
+		err(1, "%s: mkdir", name);
+	}
+	for (i=0; i<BENCHFILES; i++) {
+		snprintf(name, sizeof(name), "%s/d%d/f%d", BENCHDIR, level, i);
+		fds[i] = open(name, O_WRONLY|O_CREAT|O_EXCL, 0664);
+		if (fds[i] < 0) {
+			err(1, "%s: open", name);
+		}
+	}
+
+	for (i=0; i<(int)(sizeof(benchtimed) / sizeof(benchtimed[0])); i++) {
+		if (benchtimed[i] == level + 1) {
+			bench_time(level);
+		}
+	}
+
+	if (level + 1 < BENCHLEVELS) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			/*
+			 * Our parent's copies keep these files (and so
+			 * their vnodes) open; make room for our own.
+			 */
+			for (i=0; i<BENCHFILES; i++) {
+				close(fds[i]);
+			}
+			bench_level(level + 1);
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "level %d failed", level + 1);
+		}
+	}
+
+	for (i=0; i<BENCHFILES; i++) {
+		close(fds[i]);
+		snprintf(name, sizeof(name), "%s/d%d/f%d", BENCHDIR, level, i);
+		if (remove(name)) {
+			err(1, "%s: remove", name);
+		}
+	}
+	snprintf(name, sizeof(name), "%s/d%d", BENCHDIR, level);
+	if (rmdir(name)) {
+		err(1, "%s: rmdir", name);
+	}
+}
+
+static
+void
+bench(void)
+{
+	if (mkdir(BENCHDIR, 0755)) {
+		err(1, "%s: mkdir", BENCHDIR);
+	}
+	bench_level(0);
+	if (rmdir(BENCHDIR)) {
+		err(1, "%s: rmdir", BENCHDIR);
+	}
+}
+
 int
-main(void)
+main(int argc, char **argv)
 {
 	int i;
 	const char *onename = "testdir";
 	char dirname[512];
 
+	if (argc == 2 && !strcmp(argv[1], "-b")) {
+		bench();
+		return 0;
+	}
+	else if (argc > 1) {
+		errx(1, "Usage: dirtest [-b]");
+	}
+
 	strcpy(dirname, onename);
 
 	for (i=0; i<MAXLEVELS; i++) {
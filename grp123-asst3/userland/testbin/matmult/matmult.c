@@ -37,10 +37,19 @@
  *
  *    Once the VM system assignment is complete your system should be
  *    able to survive this.
+ *
+ *    "matmult -b" also reports how long the run took and how many
+ *    pages the arrays span per second of it. That is not a fault
+ *    count: superpages fill several pages per fault and paging adds
+ *    faults, so compare with the kernel's vmstat and tlbstat menu
+ *    commands for those.
  */
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <test/elapsed.h>
 
 #define Dim 	72	/* sum total of the arrays doesn't fit in
 			 * physical memory
@@ -53,10 +62,29 @@ int B[Dim][Dim];
 int C[Dim][Dim];
 int T[Dim][Dim][Dim];
 
+/* pages spanned by the arrays */
+#define NPAGES \
+	((sizeof(A) + sizeof(B) + sizeof(C) + sizeof(T) + 4095) / 4096)
+
 int
-main(void)
+main(int argc, char **argv)
 {
     int i, j, k, r;
+    int bench = 0;
+    time_t startsecs;
+    unsigned long startnsecs;
+    unsigned long long usecs;
+
+    if (argc == 2 && !strcmp(argv[1], "-b")) {
+	    bench = 1;
+    }
+    else if (argc > 1) {
+	    errx(1, "Usage: matmult [-b]");
+    }
+
+    if (bench) {
+	    __time(&startsecs, &startnsecs);
+    }
 
     for (i = 0; i < Dim; i++)		/* first initialize the matrices */
 	for (j = 0; j < Dim; j++) {
@@ -79,6 +107,14 @@ main(void)
     for (i = 0; i < Dim; i++)
 	    r += C[i][i];
 
+    if (bench) {
+	    usecs = elapsed(startsecs, startnsecs);
+	    printf("matmult: %lu pages in %llu.%06llu seconds, "
+		   "%llu pages/sec\n", (unsigned long) NPAGES,
+		   usecs / 1000000, usecs % 1000000,
+		   (unsigned long long) NPAGES * 1000000 / usecs);
+    }
+
     printf("matmult finished.\n");
     printf("answer is: %d (should be %d)\n", r, RIGHT);
     if (r != RIGHT) {
@@ -0,0 +1,122 @@
+/*
+ * stride.c
+ *
+ *	Measures how fast an array can be read at various strides, as
+ *	a benchmark for physical page placement. Run it once with page
+ *	coloring on and once with it off ("coloring on" / "coloring
+ *	off" at the kernel menu) and compare.
+ *
+ *	The array is small enough to fit in memory and to be faulted
+ *	in one page at a time; every page is touched before timing
+ *	starts, so only the accesses are measured.
+ *
+ *	Usage: stride [passes]
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+#include <test/elapsed.h>
+
+#define PageSize	4096
+#define NumPages	48
+#define DefPasses	16
+#define MaxPasses	4096	/* keeps the access count in an unsigned */
+
+static int array[NumPages * PageSize / sizeof(int)];
+
+/* strides in bytes */
+static const unsigned strides[] = {
+	4, 64, 512, PageSize, PageSize + 64, 2 * PageSize, 8 * PageSize,
+};
+#define NSTRIDES (sizeof(strides) / sizeof(strides[0]))
+
+/*
+ * Parse the pass count: decimal digits only, 1 to MaxPasses. atoi
+ * would take junk as 0 and a negative count as a huge one.
+ */
+static
+unsigned
+getpasses(const char *str)
+{
+	const char *s;
+	unsigned passes;
+
+	passes = 0;
+	for (s = str; *s != '\0'; s++) {
+		if (*s < '0' || *s > '9') {
+			errx(1, "%s: passes must be a number", str);
+		}
+		passes = passes * 10 + (*s - '0');
+		if (passes > MaxPasses) {
+			break;
+		}
+	}
+	if (passes == 0 || passes > MaxPasses) {
+		errx(1, "passes must be from 1 to %u", MaxPasses);
+	}
+	return passes;
+}
+
+/*
+ * Read the array PASSES times, every STRIDE bytes; each pass starts
+ * one word further on so that a large stride still covers the array.
+ */
+static
+int
+run(unsigned stride, unsigned passes, unsigned *naccesses)
+{
+	unsigned pass, off, n;
+	int sum;
+
+	sum = 0;
+	n = 0;
+	for (pass = 0; pass < passes; pass++) {
+		for (off = (pass * sizeof(int)) % stride;
+		     off < sizeof(array); off += stride) {
+			sum += array[off / sizeof(int)];
+			n++;
+		}
+	}
+	*naccesses = n;
+	return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned i, passes, n;
+	time_t startsecs;
+	unsigned long startnsecs;
+	unsigned long long usecs;
+	int sum;
+
+	passes = DefPasses;
+	if (argc == 2) {
+		passes = getpasses(argv[1]);
+	}
+	else if (argc > 2) {
+		errx(1, "Usage: stride [passes]");
+	}
+
+	/* fault everything in first */
+	for (i = 0; i < NumPages; i++) {
+		array[i * PageSize / sizeof(int)] = i;
+	}
+
+	printf("stride: %u pages, %u passes\n", NumPages, passes);
+	printf("%8s %10s %12s %14s\n", "stride", "accesses", "usecs",
+	       "accesses/sec");
+	sum = 0;
+	for (i = 0; i < NSTRIDES; i++) {
+		__time(&startsecs, &startnsecs);
+		sum += run(strides[i], passes, &n);
+		usecs = elapsed(startsecs, startnsecs);
+		printf("%8u %10u %12llu %14llu\n", strides[i], n, usecs,
+		       (unsigned long long) n * 1000000 / usecs);
+	}
+
+	/* use the result so the reads cannot be optimized away */
+	printf("checksum %d\n", sum);
+	return 0;
+}